@@ -7,10 +7,22 @@ class GameBoyAdvance {
     public: 
         GameBoyAdvance();
         bool loadRom(std::string path);
+        void reset();
         void setBreakpoint(uint32_t address);
         void enableDebugger();
         void runRom(); 
         void printCpuState();
+        // has to be called before runRom
+        void setAudioEnabled(bool enabled);
+        bool startAudioRecording(std::string wavPath);
+        void stopAudioRecording();
+        // renders on a second thread, the screen then shows the last frame that thread completed
+        void setRenderThreadEnabled(bool enabled);
+        // renders only every (frames + 1)th frame, AUTO_FRAME_SKIP leaves out frames while the emulation can't keep up
+        void setFrameSkip(int frames);
+        // off runs the emulation as fast as possible, best combined with a frame skip
+        void setFrameRateLimited(bool limited);
+        static const int AUTO_FRAME_SKIP = -1;
         // TODO: more public methods   
     
     private: 
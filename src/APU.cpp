@@ -0,0 +1,589 @@
+#include "APU.h"
+#include "memory/Bus.h"
+#include "DMA.h"
+#include "Timer.h"
+#include "GameBoyAdvanceImpl.h"
+#include "util/macros.h"
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+    // 12.5%, 25%, 50%, 75%
+    constexpr uint8_t dutyPatterns[4] = {0x01, 0x81, 0x87, 0x7E};
+
+    // the frame sequencer runs at 512 Hz
+    constexpr uint32_t samplesPerFrameSequencerStep = APU::SAMPLE_RATE / 512;
+
+    constexpr uint32_t SOUND1CNT_L = 0x60;
+    constexpr uint32_t SOUND3CNT_L = 0x70;
+    constexpr uint32_t SOUNDCNT_L = 0x80;
+    constexpr uint32_t SOUNDCNT_H = 0x82;
+    constexpr uint32_t SOUNDCNT_X = 0x84;
+    constexpr uint32_t SOUNDBIAS = 0x88;
+    constexpr uint32_t WAVE_RAM = 0x90;
+    constexpr uint32_t FIFO_A = 0xA0;
+}
+
+APU::APU() {
+    reset();
+}
+
+void APU::reset() {
+    for(int x = 0; x < 2; x++) {
+        square[x] = {};
+        fifo[x] = {};
+    }
+    wave = {};
+    noise = {};
+    masterEnable = false;
+    nextSampleCycle = GameBoyAdvanceImpl::cyclesSinceStart;
+    frameSequencerSamples = 0;
+    frameSequencerStep = 0;
+    psgLeft.fill(0);
+    psgRight.fill(0);
+    fifoSamples[0].fill(0);
+    fifoSamples[1].fill(0);
+    blockFrames = 0;
+}
+
+void APU::connectBus(std::shared_ptr<Bus> bus) {
+    this->bus = bus;
+}
+
+void APU::connectDma(std::shared_ptr<DMA> dma) {
+    this->dma = dma;
+}
+
+void APU::connectTimer(std::shared_ptr<Timer> timer) {
+    this->timer = timer;
+}
+
+void APU::setSampleCallback(SampleCallback callback, void* context) {
+    sampleCallback = callback;
+    sampleCallbackContext = context;
+}
+
+void APU::catchUp() {
+    // let the fifo timers hand over the samples consumed so far first
+    timer->flushOverflows();
+    renderUntil(GameBoyAdvanceImpl::cyclesSinceStart);
+}
+
+void APU::renderUntil(uint64_t cycle) {
+    while(nextSampleCycle <= cycle) {
+        renderSample();
+        nextSampleCycle += CYCLES_PER_SAMPLE;
+    }
+}
+
+void APU::renderSample() {
+    if(frameSequencerSamples == 0) {
+        stepFrameSequencer();
+    }
+    frameSequencerSamples = (frameSequencerSamples + 1) % samplesPerFrameSequencerStep;
+
+    int16_t left = 0;
+    int16_t right = 0;
+    if(masterEnable) {
+        int16_t channelOutput[4] = {0, 0, 0, 0};
+
+        for(int x = 0; x < 2; x++) {
+            SquareChannel& channel = square[x];
+            if(!channel.enabled) {
+                continue;
+            }
+            int32_t period = 16 * (2048 - channel.frequency);
+            channel.timer -= CYCLES_PER_SAMPLE;
+            if(channel.timer <= 0) {
+                int32_t steps = (-channel.timer) / period + 1;
+                channel.dutyStep = (channel.dutyStep + steps) & 0x7;
+                channel.timer += steps * period;
+            }
+            bool high = (dutyPatterns[channel.duty] >> channel.dutyStep) & 0x1;
+            channelOutput[x] = high ? channel.envelope.volume : -channel.envelope.volume;
+        }
+
+        if(wave.enabled) {
+            int32_t period = 8 * (2048 - wave.frequency);
+            uint8_t sampleCount = wave.twoBanks ? 64 : 32;
+            wave.timer -= CYCLES_PER_SAMPLE;
+            if(wave.timer <= 0) {
+                int32_t steps = (-wave.timer) / period + 1;
+                wave.position = (wave.position + steps) % sampleCount;
+                wave.timer += steps * period;
+            }
+            uint8_t bank = (wave.playingBank + (wave.position >> 5)) & 0x1;
+            uint8_t byte = wave.waveRam[bank][(wave.position & 0x1F) >> 1];
+            int16_t sample = (wave.position & 0x1) ? (byte & 0xF) : (byte >> 4);
+            sample = sample * 2 - 15;
+            if(wave.forceThreeQuarters) {
+                sample = sample * 3 / 4;
+            } else if(wave.volumeShift == 0) {
+                sample = 0;
+            } else {
+                sample = sample / (1 << (wave.volumeShift - 1));
+            }
+            channelOutput[2] = sample;
+        }
+
+        if(noise.enabled) {
+            uint16_t control = readRegister16(0x7C);
+            uint8_t shift = (control >> 4) & 0xF;
+            if(shift < 14) {
+                uint8_t ratio = control & 0x7;
+                int32_t period = (ratio == 0 ? 16 : 32 * ratio) << (shift + 1);
+                noise.timer -= CYCLES_PER_SAMPLE;
+                while(noise.timer <= 0) {
+                    noise.timer += period;
+                    uint16_t bit = (noise.lfsr ^ (noise.lfsr >> 1)) & 0x1;
+                    noise.lfsr = (noise.lfsr >> 1) | (bit << 14);
+                    if(noise.sevenBit) {
+                        noise.lfsr = (noise.lfsr & ~0x40) | (bit << 6);
+                    }
+                }
+            }
+            channelOutput[3] = (noise.lfsr & 0x1) ? -noise.envelope.volume : noise.envelope.volume;
+        }
+
+        uint16_t soundCntL = readRegister16(SOUNDCNT_L);
+        for(int x = 0; x < 4; x++) {
+            if(soundCntL & (0x100 << x)) {
+                right += channelOutput[x];
+            }
+            if(soundCntL & (0x1000 << x)) {
+                left += channelOutput[x];
+            }
+        }
+        right *= (soundCntL & 0x7) + 1;
+        left *= ((soundCntL >> 4) & 0x7) + 1;
+
+        // psg volume ratio 25%, 50%, 100%
+        uint8_t psgRatio = readRegister16(SOUNDCNT_H) & 0x3;
+        uint8_t psgShift = psgRatio >= 2 ? 0 : 2 - psgRatio;
+        right >>= psgShift;
+        left >>= psgShift;
+    }
+
+    psgLeft[blockFrames] = left;
+    psgRight[blockFrames] = right;
+    fifoSamples[0][blockFrames] = masterEnable ? fifo[0].currentSample : 0;
+    fifoSamples[1][blockFrames] = masterEnable ? fifo[1].currentSample : 0;
+    blockFrames++;
+    if(blockFrames == SAMPLES_PER_BLOCK) {
+        mixBlock();
+    }
+}
+
+void APU::stepFrameSequencer() {
+    // length at 256 Hz, sweep at 128 Hz, envelope at 64 Hz
+    if((frameSequencerStep & 0x1) == 0) {
+        for(int x = 0; x < 2; x++) {
+            if(square[x].lengthEnable && square[x].length != 0 && --square[x].length == 0) {
+                square[x].enabled = false;
+            }
+        }
+        if(wave.lengthEnable && wave.length != 0 && --wave.length == 0) {
+            wave.enabled = false;
+        }
+        if(noise.lengthEnable && noise.length != 0 && --noise.length == 0) {
+            noise.enabled = false;
+        }
+    }
+
+    if(frameSequencerStep == 2 || frameSequencerStep == 6) {
+        SquareChannel& channel = square[0];
+        if(channel.sweepTimer != 0 && --channel.sweepTimer == 0) {
+            channel.sweepTimer = channel.sweepTime != 0 ? channel.sweepTime : 8;
+            if(channel.enabled && channel.sweepTime != 0) {
+                uint16_t newFrequency = calculateSweepFrequency();
+                if(newFrequency > 2047) {
+                    channel.enabled = false;
+                } else if(channel.sweepShift != 0) {
+                    channel.frequency = newFrequency;
+                    channel.shadowFrequency = newFrequency;
+                }
+            }
+        }
+    }
+
+    if(frameSequencerStep == 7) {
+        stepEnvelope(square[0].envelope);
+        stepEnvelope(square[1].envelope);
+        stepEnvelope(noise.envelope);
+    }
+
+    frameSequencerStep = (frameSequencerStep + 1) & 0x7;
+}
+
+void APU::mixBlock() {
+    if(blockFrames == 0) {
+        return;
+    }
+
+    uint16_t soundCntH = readRegister16(SOUNDCNT_H);
+    int16_t bias = readRegister16(SOUNDBIAS) & 0x3FE;
+    // fifo volume 50% or 100%
+    int fifoShift[2] = {(soundCntH & 0x4) ? 2 : 1, (soundCntH & 0x8) ? 2 : 1};
+    int16_t fifoRight[2] = {(soundCntH & 0x0100) ? (int16_t)-1 : (int16_t)0, (soundCntH & 0x1000) ? (int16_t)-1 : (int16_t)0};
+    int16_t fifoLeft[2] = {(soundCntH & 0x0200) ? (int16_t)-1 : (int16_t)0, (soundCntH & 0x2000) ? (int16_t)-1 : (int16_t)0};
+
+#ifdef __SSE2__
+    // 8 frames at a time, the buffers are sized in multiples of 8 so the tail can be processed in full
+    const __m128i shiftA = _mm_cvtsi32_si128(fifoShift[0]);
+    const __m128i shiftB = _mm_cvtsi32_si128(fifoShift[1]);
+    const __m128i maskAR = _mm_set1_epi16(fifoRight[0]);
+    const __m128i maskBR = _mm_set1_epi16(fifoRight[1]);
+    const __m128i maskAL = _mm_set1_epi16(fifoLeft[0]);
+    const __m128i maskBL = _mm_set1_epi16(fifoLeft[1]);
+    const __m128i biasVec = _mm_set1_epi16(bias);
+    const __m128i center = _mm_set1_epi16(0x200);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i maxLevel = _mm_set1_epi16(0x3FF);
+    for(uint32_t i = 0; i < blockFrames; i += 8) {
+        __m128i a = _mm_sll_epi16(_mm_load_si128((const __m128i*)&fifoSamples[0][i]), shiftA);
+        __m128i b = _mm_sll_epi16(_mm_load_si128((const __m128i*)&fifoSamples[1][i]), shiftB);
+
+        __m128i left = _mm_load_si128((const __m128i*)&psgLeft[i]);
+        left = _mm_add_epi16(left, _mm_and_si128(a, maskAL));
+        left = _mm_add_epi16(left, _mm_and_si128(b, maskBL));
+        __m128i right = _mm_load_si128((const __m128i*)&psgRight[i]);
+        right = _mm_add_epi16(right, _mm_and_si128(a, maskAR));
+        right = _mm_add_epi16(right, _mm_and_si128(b, maskBR));
+
+        // the output is biased and clipped to 10 bits like the hardware pwm, then centered
+        left = _mm_min_epi16(_mm_max_epi16(_mm_add_epi16(left, biasVec), zero), maxLevel);
+        right = _mm_min_epi16(_mm_max_epi16(_mm_add_epi16(right, biasVec), zero), maxLevel);
+        left = _mm_slli_epi16(_mm_sub_epi16(left, center), 6);
+        right = _mm_slli_epi16(_mm_sub_epi16(right, center), 6);
+
+        _mm_store_si128((__m128i*)&mixedBlock[i * 2], _mm_unpacklo_epi16(left, right));
+        _mm_store_si128((__m128i*)&mixedBlock[i * 2 + 8], _mm_unpackhi_epi16(left, right));
+    }
+#else
+    for(uint32_t i = 0; i < blockFrames; i++) {
+        int16_t a = fifoSamples[0][i] << fifoShift[0];
+        int16_t b = fifoSamples[1][i] << fifoShift[1];
+        int16_t left = psgLeft[i] + (a & fifoLeft[0]) + (b & fifoLeft[1]) + bias;
+        int16_t right = psgRight[i] + (a & fifoRight[0]) + (b & fifoRight[1]) + bias;
+        left = std::min<int16_t>(std::max<int16_t>(left, 0), 0x3FF);
+        right = std::min<int16_t>(std::max<int16_t>(right, 0), 0x3FF);
+        mixedBlock[i * 2] = (left - 0x200) * 64;
+        mixedBlock[i * 2 + 1] = (right - 0x200) * 64;
+    }
+#endif
+
+    if(sampleCallback != nullptr) {
+        sampleCallback(sampleCallbackContext, mixedBlock.data(), blockFrames);
+    }
+    blockFrames = 0;
+}
+
+uint32_t APU::getTimerXOverflowBatch(uint8_t x) {
+    // overflows until the fullest fifo on this timer drops to 16 bytes and requests a refill
+    uint32_t batch = 0;
+    for(uint8_t f = 0; f < 2; f++) {
+        if(!isFifoXUsingTimer(f, x)) {
+            continue;
+        }
+        uint32_t overflows = fifo[f].count > 16 ? fifo[f].count - 16 : 1;
+        batch = batch == 0 ? overflows : std::min(batch, overflows);
+    }
+    return batch;
+}
+
+void APU::timerXOverflow(uint8_t x, uint32_t overflows, uint64_t lastOverflowCycle, uint64_t periodCycles) {
+    bool used[2] = {isFifoXUsingTimer(0, x), isFifoXUsingTimer(1, x)};
+    if(!used[0] && !used[1]) {
+        return;
+    }
+
+    for(uint32_t i = 0; i < overflows; i++) {
+        // samples before each overflow still play the previous fifo sample
+        renderUntil(lastOverflowCycle - (uint64_t)(overflows - 1 - i) * periodCycles);
+        for(uint8_t f = 0; f < 2; f++) {
+            if(used[f] && fifo[f].count != 0) {
+                fifo[f].currentSample = fifo[f].buffer[fifo[f].readIndex];
+                fifo[f].readIndex = (fifo[f].readIndex + 1) & 0x1F;
+                fifo[f].count--;
+            }
+        }
+    }
+
+    for(uint8_t f = 0; f < 2; f++) {
+        if(used[f] && fifo[f].count <= 16) {
+            dma->triggerSoundFifoDmas(f);
+        }
+    }
+}
+
+bool APU::isFifoXUsingTimer(uint8_t fifoX, uint8_t timerX) {
+    if(!masterEnable) {
+        return false;
+    }
+    uint16_t soundCntH = readRegister16(SOUNDCNT_H);
+    uint8_t settings = soundCntH >> (8 + 4 * fifoX);
+    // enable right / left and timer select
+    return (settings & 0x3) && ((settings >> 2) & 0x1) == timerX;
+}
+
+void APU::pushFifo(uint8_t x, int8_t sample) {
+    if(fifo[x].count == 32) {
+        DEBUG("sound fifo overflow\n");
+        return;
+    }
+    fifo[x].buffer[(fifo[x].readIndex + fifo[x].count) & 0x1F] = sample;
+    fifo[x].count++;
+}
+
+void APU::resetFifo(uint8_t x) {
+    fifo[x].readIndex = 0;
+    fifo[x].count = 0;
+}
+
+void APU::prepareForApuWrite(uint32_t address, uint8_t width) {
+    catchUp();
+    uint32_t upperLimit = address + (width / 8);
+    if(0x4000082 < upperLimit && address <= 0x4000089) {
+        // the mixer settings are applied per block, so finish the block with the old settings
+        mixBlock();
+    }
+}
+
+void APU::updateApuUponWrite(uint32_t address, uint32_t value, uint8_t width) {
+    bool fifoSettingsChanged = false;
+    while(width != 0) {
+        uint32_t ioOffset = address - 0x4000000;
+        if(SOUND1CNT_L <= ioOffset && ioOffset < FIFO_A + 8) {
+            writeRegisterByte(ioOffset, value & 0xFF);
+            fifoSettingsChanged |= ioOffset >= SOUNDCNT_H;
+        }
+
+        width -= 8;
+        address += 1;
+        value = value >> 8;
+    }
+    if(fifoSettingsChanged) {
+        // fifo levels or the timers feeding them changed
+        timer->updateTimerScheduling();
+    }
+}
+
+void APU::updateBusToPrepareForApuRead() {
+    catchUp();
+    uint8_t status = (square[0].enabled ? 0x1 : 0) | (square[1].enabled ? 0x2 : 0) |
+                     (wave.enabled ? 0x4 : 0) | (noise.enabled ? 0x8 : 0);
+    bus->iORegisters[SOUNDCNT_X] = (bus->iORegisters[SOUNDCNT_X] & 0xF0) | status;
+}
+
+void APU::writeRegisterByte(uint32_t ioOffset, uint8_t value) {
+    if(!masterEnable && ioOffset < SOUNDCNT_H) {
+        // psg registers can't be written while the sound circuit is off
+        bus->iORegisters[ioOffset] = 0;
+        return;
+    }
+
+    switch(ioOffset) {
+        case SOUND1CNT_L: {
+            square[0].sweepShift = value & 0x7;
+            square[0].sweepDecrease = value & 0x8;
+            square[0].sweepTime = (value >> 4) & 0x7;
+            break;
+        }
+        case 0x62:
+        case 0x68: {
+            SquareChannel& channel = square[ioOffset == 0x62 ? 0 : 1];
+            channel.length = 64 - (value & 0x3F);
+            channel.duty = value >> 6;
+            break;
+        }
+        case 0x63:
+        case 0x69: {
+            SquareChannel& channel = square[ioOffset == 0x63 ? 0 : 1];
+            loadEnvelope(channel.envelope, value);
+            if((value & 0xF8) == 0) {
+                // dac off
+                channel.enabled = false;
+            }
+            break;
+        }
+        case 0x64:
+        case 0x6C: {
+            SquareChannel& channel = square[ioOffset == 0x64 ? 0 : 1];
+            channel.frequency = (channel.frequency & 0x700) | value;
+            break;
+        }
+        case 0x65:
+        case 0x6D: {
+            uint8_t x = ioOffset == 0x65 ? 0 : 1;
+            square[x].frequency = (square[x].frequency & 0xFF) | ((uint16_t)(value & 0x7) << 8);
+            square[x].lengthEnable = value & 0x40;
+            if(value & 0x80) {
+                triggerSquare(x);
+            }
+            break;
+        }
+        case SOUND3CNT_L: {
+            wave.twoBanks = value & 0x20;
+            wave.playingBank = (value >> 6) & 0x1;
+            wave.dacEnabled = value & 0x80;
+            if(!wave.dacEnabled) {
+                wave.enabled = false;
+            }
+            break;
+        }
+        case 0x72: {
+            wave.length = 256 - value;
+            break;
+        }
+        case 0x73: {
+            wave.volumeShift = (value >> 5) & 0x3;
+            wave.forceThreeQuarters = value & 0x80;
+            break;
+        }
+        case 0x74: {
+            wave.frequency = (wave.frequency & 0x700) | value;
+            break;
+        }
+        case 0x75: {
+            wave.frequency = (wave.frequency & 0xFF) | ((uint16_t)(value & 0x7) << 8);
+            wave.lengthEnable = value & 0x40;
+            if(value & 0x80) {
+                triggerWave();
+            }
+            break;
+        }
+        case 0x78: {
+            noise.length = 64 - (value & 0x3F);
+            break;
+        }
+        case 0x79: {
+            loadEnvelope(noise.envelope, value);
+            if((value & 0xF8) == 0) {
+                noise.enabled = false;
+            }
+            break;
+        }
+        case 0x7C: {
+            noise.sevenBit = value & 0x8;
+            break;
+        }
+        case 0x7D: {
+            noise.lengthEnable = value & 0x40;
+            if(value & 0x80) {
+                triggerNoise();
+            }
+            break;
+        }
+        case SOUNDCNT_H + 1: {
+            if(value & 0x08) {
+                resetFifo(0);
+            }
+            if(value & 0x80) {
+                resetFifo(1);
+            }
+            // the reset bits always read as zero
+            bus->iORegisters[ioOffset] &= 0x77;
+            break;
+        }
+        case SOUNDCNT_X: {
+            bool enable = value & 0x80;
+            if(masterEnable && !enable) {
+                // turning the sound circuit off resets the psg registers
+                std::fill(&bus->iORegisters[SOUND1CNT_L], &bus->iORegisters[SOUNDCNT_H], 0);
+                square[0] = {};
+                square[1] = {};
+                std::array<std::array<uint8_t, 16>, 2> waveRam = wave.waveRam;
+                wave = {};
+                wave.waveRam = waveRam;
+                noise = {};
+                resetFifo(0);
+                resetFifo(1);
+            }
+            masterEnable = enable;
+            break;
+        }
+        default: {
+            if(WAVE_RAM <= ioOffset && ioOffset < WAVE_RAM + 0x10) {
+                // the cpu accesses the bank that is not being played
+                wave.waveRam[wave.playingBank ^ 1][ioOffset - WAVE_RAM] = value;
+            } else if(FIFO_A <= ioOffset && ioOffset < FIFO_A + 8) {
+                pushFifo((ioOffset - FIFO_A) >> 2, (int8_t)value);
+            }
+            break;
+        }
+    }
+}
+
+void APU::triggerSquare(uint8_t x) {
+    SquareChannel& channel = square[x];
+    channel.enabled = (channel.envelope.initialVolume != 0) || channel.envelope.increase;
+    if(channel.length == 0) {
+        channel.length = 64;
+    }
+    channel.timer = 16 * (2048 - channel.frequency);
+    channel.envelope.volume = channel.envelope.initialVolume;
+    channel.envelope.timer = channel.envelope.stepTime;
+
+    if(x == 0) {
+        channel.shadowFrequency = channel.frequency;
+        channel.sweepTimer = channel.sweepTime != 0 ? channel.sweepTime : 8;
+        if(channel.sweepShift != 0 && calculateSweepFrequency() > 2047) {
+            channel.enabled = false;
+        }
+    }
+}
+
+void APU::triggerWave() {
+    wave.enabled = wave.dacEnabled;
+    if(wave.length == 0) {
+        wave.length = 256;
+    }
+    wave.position = 0;
+    wave.timer = 8 * (2048 - wave.frequency);
+}
+
+void APU::triggerNoise() {
+    noise.enabled = (noise.envelope.initialVolume != 0) || noise.envelope.increase;
+    if(noise.length == 0) {
+        noise.length = 64;
+    }
+    noise.lfsr = noise.sevenBit ? 0x7F : 0x7FFF;
+    noise.timer = 0;
+    noise.envelope.volume = noise.envelope.initialVolume;
+    noise.envelope.timer = noise.envelope.stepTime;
+}
+
+uint16_t APU::calculateSweepFrequency() {
+    SquareChannel& channel = square[0];
+    uint16_t delta = channel.shadowFrequency >> channel.sweepShift;
+    return channel.sweepDecrease ? channel.shadowFrequency - delta : channel.shadowFrequency + delta;
+}
+
+void APU::loadEnvelope(Envelope& envelope, uint8_t value) {
+    envelope.stepTime = value & 0x7;
+    envelope.increase = value & 0x8;
+    envelope.initialVolume = value >> 4;
+}
+
+void APU::stepEnvelope(Envelope& envelope) {
+    if(envelope.stepTime == 0) {
+        return;
+    }
+    if(envelope.timer > 1) {
+        envelope.timer--;
+        return;
+    }
+    envelope.timer = envelope.stepTime;
+    if(envelope.increase && envelope.volume < 15) {
+        envelope.volume++;
+    } else if(!envelope.increase && envelope.volume > 0) {
+        envelope.volume--;
+    }
+}
+
+uint16_t APU::readRegister16(uint32_t ioOffset) {
+    return (uint16_t)bus->iORegisters[ioOffset] | ((uint16_t)bus->iORegisters[ioOffset + 1] << 8);
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <array>
+
+class Bus;
+class DMA;
+class Timer;
+
+/*
+    Sound controller: the four PSG channels and the two Direct Sound FIFOs.
+    Nothing is scheduled per sample, samples are rendered by catching up to the current cycle
+    whenever a sound register is written, a FIFO timer overflows or a frame ends.
+    Rendered samples are collected in blocks and mixed to signed 16 bit stereo at once.
+*/
+class APU {
+
+    public:
+        // 16777216 / 512, the native rate of the sound circuit at the default SOUNDBIAS resolution
+        static constexpr uint32_t SAMPLE_RATE = 32768;
+        static constexpr uint32_t CYCLES_PER_SAMPLE = 512;
+        // stereo frames per mixed block
+        static constexpr uint32_t SAMPLES_PER_BLOCK = 256;
+
+        // receives interleaved left / right samples
+        typedef void (*SampleCallback)(void* context, const int16_t* samples, uint32_t frameCount);
+
+        APU();
+
+        void connectBus(std::shared_ptr<Bus> bus);
+        void connectDma(std::shared_ptr<DMA> dma);
+        void connectTimer(std::shared_ptr<Timer> timer);
+
+        void setSampleCallback(SampleCallback callback, void* context);
+
+        // renders all samples up to the current cycle
+        void catchUp();
+
+        // called by the bus before and after writes to 4000060h-40000A7h
+        void prepareForApuWrite(uint32_t address, uint8_t width);
+        void updateApuUponWrite(uint32_t address, uint32_t value, uint8_t width);
+        // writes the channel status bits of SOUNDCNT_X to the bus
+        void updateBusToPrepareForApuRead();
+
+        // number of overflows of timer x after which a FIFO needs a refill, 0 if no FIFO uses timer x
+        uint32_t getTimerXOverflowBatch(uint8_t x);
+        // a batch of overflows of timer x, the last one at lastOverflowCycle
+        void timerXOverflow(uint8_t x, uint32_t overflows, uint64_t lastOverflowCycle, uint64_t periodCycles);
+
+        void reset();
+
+    private:
+        std::shared_ptr<Bus> bus;
+        std::shared_ptr<DMA> dma;
+        std::shared_ptr<Timer> timer;
+
+        SampleCallback sampleCallback = nullptr;
+        void* sampleCallbackContext = nullptr;
+
+        struct Envelope {
+            uint8_t volume;
+            uint8_t initialVolume;
+            bool increase;
+            uint8_t stepTime;
+            uint8_t timer;
+        };
+
+        struct SquareChannel {
+            bool enabled;
+            uint8_t duty;
+            uint8_t dutyStep;
+            uint16_t frequency;
+            int32_t timer;
+            uint16_t length;
+            bool lengthEnable;
+            Envelope envelope;
+            // sweep, channel 1 only
+            uint8_t sweepShift;
+            bool sweepDecrease;
+            uint8_t sweepTime;
+            uint8_t sweepTimer;
+            uint16_t shadowFrequency;
+        };
+
+        struct WaveChannel {
+            bool enabled;
+            bool dacEnabled;
+            bool twoBanks;
+            uint8_t playingBank;
+            uint8_t position;
+            uint16_t frequency;
+            int32_t timer;
+            uint16_t length;
+            bool lengthEnable;
+            uint8_t volumeShift;
+            bool forceThreeQuarters;
+            std::array<std::array<uint8_t, 16>, 2> waveRam;
+        };
+
+        struct NoiseChannel {
+            bool enabled;
+            uint16_t lfsr;
+            bool sevenBit;
+            int32_t timer;
+            uint16_t length;
+            bool lengthEnable;
+            Envelope envelope;
+        };
+
+        struct Fifo {
+            std::array<int8_t, 32> buffer;
+            uint8_t readIndex;
+            uint8_t count;
+            int8_t currentSample;
+        };
+
+        SquareChannel square[2];
+        WaveChannel wave;
+        NoiseChannel noise;
+        Fifo fifo[2];
+
+        bool masterEnable;
+        // cycle of the next sample to render
+        uint64_t nextSampleCycle;
+        uint32_t frameSequencerSamples;
+        uint8_t frameSequencerStep;
+
+        // per sample components of the current block, mixed in mixBlock()
+        alignas(16) std::array<int16_t, SAMPLES_PER_BLOCK> psgLeft;
+        alignas(16) std::array<int16_t, SAMPLES_PER_BLOCK> psgRight;
+        alignas(16) std::array<int16_t, SAMPLES_PER_BLOCK> fifoSamples[2];
+        alignas(16) std::array<int16_t, SAMPLES_PER_BLOCK * 2> mixedBlock;
+        uint32_t blockFrames;
+
+        void renderUntil(uint64_t cycle);
+        void renderSample();
+        void stepFrameSequencer();
+        // mixes the samples of the current block and hands them to the sample callback
+        void mixBlock();
+
+        void writeRegisterByte(uint32_t address, uint8_t value);
+        void triggerSquare(uint8_t x);
+        void triggerWave();
+        void triggerNoise();
+        void pushFifo(uint8_t x, int8_t sample);
+        void resetFifo(uint8_t x);
+        bool isFifoXUsingTimer(uint8_t fifoX, uint8_t timerX);
+
+        uint16_t readRegister16(uint32_t ioOffset);
+        uint16_t calculateSweepFrequency();
+        static void stepEnvelope(Envelope& envelope);
+        static void loadEnvelope(Envelope& envelope, uint8_t value);
+};
@@ -0,0 +1,63 @@
+#include "AudioStream.h"
+#include "APU.h"
+#include <algorithm>
+
+AudioStream::AudioStream() {
+    initialize(2, HOST_SAMPLE_RATE);
+}
+
+void AudioStream::pushSamples(const int16_t* data, uint32_t frameCount) {
+    // when the buffer is full the newest samples are dropped, the rate control catches up again
+    samples.push(data, frameCount * 2);
+}
+
+size_t AudioStream::getBufferedFrames() const {
+    return samples.size() / 2;
+}
+
+bool AudioStream::waitForBufferedFrames(size_t maxFrames, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(consumedMutex);
+    return consumed.wait_for(lock, timeout, [&]() { return getBufferedFrames() <= maxFrames; });
+}
+
+bool AudioStream::onGetData(Chunk& data) {
+    double fill = (double)getBufferedFrames() / TARGET_BUFFERED_FRAMES;
+    double adjustment = std::clamp((fill - 1.0) * MAX_RATE_ADJUSTMENT, -MAX_RATE_ADJUSTMENT, MAX_RATE_ADJUSTMENT);
+    double step = (double)APU::SAMPLE_RATE / HOST_SAMPLE_RATE * (1.0 + adjustment);
+
+    size_t neededFrames = std::min((size_t)(phase + CHUNK_FRAMES * step), staging.size() / 2);
+    size_t availableFrames = samples.pop(staging.data(), neededFrames * 2) / 2;
+    size_t stagingFrame = 0;
+
+    // linear interpolation between the two native frames around each host frame
+    for(size_t i = 0; i < CHUNK_FRAMES; i++) {
+        for(int c = 0; c < 2; c++) {
+            chunk[i * 2 + c] = (int16_t)(currentFrame[c] + (nextFrame[c] - currentFrame[c]) * phase);
+        }
+        phase += step;
+        while(phase >= 1.0) {
+            phase -= 1.0;
+            currentFrame[0] = nextFrame[0];
+            currentFrame[1] = nextFrame[1];
+            if(stagingFrame < availableFrames) {
+                nextFrame[0] = staging[stagingFrame * 2];
+                nextFrame[1] = staging[stagingFrame * 2 + 1];
+                stagingFrame++;
+            }
+            // on underrun the last frame is held
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(consumedMutex);
+    }
+    consumed.notify_all();
+
+    data.samples = chunk.data();
+    data.sampleCount = chunk.size();
+    return true;
+}
+
+void AudioStream::onSeek(sf::Time timeOffset) {
+    // live stream, nothing to seek
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <SFML/Audio.hpp>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include "util/RingBuffer.h"
+
+/*
+    Plays the samples of the APU through SFML.
+    The emulation thread pushes native rate samples into a lock free ring buffer,
+    the audio thread resamples them to the host rate. The playback rate is nudged slightly
+    depending on how full the buffer is, so the latency stays near its target without clicks.
+*/
+class AudioStream : public sf::SoundStream {
+
+    public:
+        static constexpr unsigned int HOST_SAMPLE_RATE = 48000;
+        // about 62ms at the native rate
+        static constexpr size_t TARGET_BUFFERED_FRAMES = 2048;
+
+        AudioStream();
+
+        // emulation thread, interleaved stereo at APU::SAMPLE_RATE
+        void pushSamples(const int16_t* samples, uint32_t frameCount);
+
+        size_t getBufferedFrames() const;
+
+        // blocks until at most maxFrames are buffered.
+        // false if the audio thread didn't consume enough before the timeout
+        bool waitForBufferedFrames(size_t maxFrames, std::chrono::milliseconds timeout);
+
+    protected:
+        bool onGetData(Chunk& data) override;
+        void onSeek(sf::Time timeOffset) override;
+
+    private:
+        static constexpr size_t CHUNK_FRAMES = 1024;
+        // the rate is adjusted by at most half a percent, which is not audible as a pitch change
+        static constexpr double MAX_RATE_ADJUSTMENT = 0.005;
+
+        RingBuffer<int16_t, 16384> samples;
+
+        // audio thread state
+        std::array<int16_t, CHUNK_FRAMES * 2> chunk;
+        std::array<int16_t, CHUNK_FRAMES * 2 * 2> staging;
+        int16_t currentFrame[2] = {0, 0};
+        int16_t nextFrame[2] = {0, 0};
+        double phase = 0.0;
+
+        std::mutex consumedMutex;
+        std::condition_variable consumed;
+};
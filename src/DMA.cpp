@@ -6,11 +6,13 @@
 #include "Scheduler.h"
 #include "assert.h"
 #include "memory/EEPROM.h"
+#include <algorithm>
+#include <cstring>
 
 
 // TODO: DMA specs not fully implemented yet
 // TODO: fix mgba suite ROM Load DMA0 tests, which fail
-uint32_t DMA::dmaX(uint8_t x, bool vBlank, bool hBlank, uint16_t scanline) {
+uint32_t DMA::dmaX(uint8_t x, bool vBlank, bool hBlank, uint16_t scanline, bool soundFifo) {
     // TODO: optimization of this....
     // TODO: The 'Special' setting (Start Timing=3) depends on the DMA channel:DMA0=Prohibited, DMA1/DMA2=Sound FIFO, DMA3=Video Capture
     uint32_t ioRegOffset =  0xC * x;
@@ -22,9 +24,8 @@ uint32_t DMA::dmaX(uint8_t x, bool vBlank, bool hBlank, uint16_t scanline) {
     uint8_t startTiming = (control & 0x3000) >> 12;
     if(startTiming == 3) {
         if(x == 1 || x == 2) {
-            // sound FIFO mode
-            if(false /*TODO: if soundControllerRequest*/) {
-            } else {
+            // sound FIFO mode, only runs when the apu requests data
+            if(!soundFifo) {
                 return 0;
             }
         } else if(x == 3) {
@@ -159,6 +160,11 @@ uint32_t DMA::dmaX(uint8_t x, bool vBlank, bool hBlank, uint16_t scanline) {
                 break;
             }
         }
+
+        if(soundFifo) {
+            // sound fifo dmas always transfer 4 words, the word count is ignored
+            dmaXWordCount[x] = 4;
+        }
     }
 
 
@@ -177,86 +183,38 @@ uint32_t DMA::dmaX(uint8_t x, bool vBlank, bool hBlank, uint16_t scanline) {
         }
     }
 
-    bool thirtyTwoBit = control & 0x0400; //  (0=16bit, 1=32bit)
+    bool thirtyTwoBit = (control & 0x0400) || soundFifo; //  (0=16bit, 1=32bit)
     bool firstAccess = true;
  
-    uint8_t destAdjust = (control & 0x0060) >> 5;
+    // sound fifo dmas always write to the fixed fifo address
+    uint8_t destAdjust = soundFifo ? 2 : (control & 0x0060) >> 5;
     uint8_t srcAdjust = (control & 0x0180) >> 7;
     assert(srcAdjust != 3);
 
-    uint32_t offset = thirtyTwoBit ? 4 : 2;
-
     // writing / reading from memeory
     // TODO: implement DMA open bus (some games are dependent on it and wil help pass mgba test suite)
-    for(uint32_t i = 0; i < dmaXWordCount[x]; i++) {
-        if(thirtyTwoBit) {
-            if(firstAccess) { 
-                uint32_t value = bus->read32(dmaXSourceAddr[x] & 0xFFFFFFFC, Bus::CycleType::NONSEQUENTIAL);
-                //uint32_t value = bus->read32(dmaXSourceAddr[x], Bus::NONSEQUENTIAL);
-                bus->write32(dmaXDestAddr[x] & 0xFFFFFFFC, value, Bus::NONSEQUENTIAL);
-                firstAccess = false;
-            } else {
-                uint32_t value = bus->read32(dmaXSourceAddr[x] & 0xFFFFFFFC, Bus::CycleType::SEQUENTIAL);
-                bus->write32(dmaXDestAddr[x] & 0xFFFFFFFC, value, Bus::SEQUENTIAL);
-            }
-        } else {
-            if(firstAccess) { 
-                uint16_t value = bus->read16(dmaXSourceAddr[x] & 0xFFFFFFFE, Bus::CycleType::NONSEQUENTIAL);
-                bus->write16(dmaXDestAddr[x] & 0xFFFFFFFE, value, Bus::NONSEQUENTIAL);
-                firstAccess = false;
-            } else {
-                uint16_t value = bus->read16(dmaXSourceAddr[x] & 0xFFFFFFFE, Bus::CycleType::SEQUENTIAL);
-                bus->write16(dmaXDestAddr[x] & 0xFFFFFFFE, value, Bus::SEQUENTIAL);
-            }
+    uint32_t unitsDone = 0;
+    while(unitsDone < dmaXWordCount[x]) {
+        // the transfer runs in chunks that end where a higher priority event would interrupt it
+        uint32_t units = std::min(dmaXWordCount[x] - unitsDone, unitsBeforeInterruption(x));
+        if(!bulkTransfer(x, units, thirtyTwoBit, srcAdjust, destAdjust)) {
+            // io registers, save memory and mirror wraps go through the bus.
+            // bus writes can schedule events, so these are done one unit at a time
+            units = 1;
+            transferUnit(x, thirtyTwoBit, firstAccess, srcAdjust, destAdjust);
         }
+        firstAccess = false;
+        unitsDone += units;
 
         // TODO: TEMPORARY CYCLE COUNTING UNTIL WAITSTATES DONE PROPERLY
-        // iterating source memory pointer
-        // (0=Increment,1=Decrement,2=Fixed,3=prohibited)
-        switch(srcAdjust) {
-            case 0: {
-                dmaXSourceAddr[x] += offset;
-                break;
-            }
-            case 1: {
-                dmaXSourceAddr[x] -= offset;
-                break;
-            }
-            case 2: {
-                break;
-            }
-            default: {
-                break;
-            }
-        }
-
-        // iterating dest memory pointer
-        // (0=Increment,1=Decrement,2=Fixed,3=Increment/Reload)
-        switch(destAdjust) {
-            case 0:
-            case 3: {
-                dmaXDestAddr[x] += offset;
-                break;
-            }
-            case 1: {
-                dmaXDestAddr[x] -= offset;
-                break;
-            }
-            case 2: {
-                break;
-            }
-            default: {
-                break;
-            }
-        }
-        GameBoyAdvanceImpl::cyclesSinceStart += 2;
+        GameBoyAdvanceImpl::cyclesSinceStart += 2 * units;
 
         if(GameBoyAdvanceImpl::cyclesSinceStart >= scheduler->peekNextEvent()->startCycle) {
             // another event occurred during this dma! exit to handle that event
             // while scheduling this one immediately to resume after the event
             if((scheduler->peekNextEvent()->eventType) < Scheduler::convertDmaValToDmaEvent(x)) {
                 scheduleDmaX(x, (control >> 8), true);
-                dmaXWordCount[x] -= (i + 1);;
+                dmaXWordCount[x] -= unitsDone;
                 return tempCycles;
             }
         }
@@ -272,13 +230,15 @@ uint32_t DMA::dmaX(uint8_t x, bool vBlank, bool hBlank, uint16_t scanline) {
         // else, dma repeat is set, so schedule next dma
         if((startTiming == 2 && scanline >= (PPU::SCREEN_HEIGHT - 1)) || startTiming == 1 || 
            (startTiming == 3 && x == 3 && scanline >= 162))
-            /* TODO: || (startTiming == 3 && (x == 1 || x == 2) && soundControllerFifoRequest) || 
-                        (startTiming == 3 && x == 3 && scanline >= (PPU::SCREEN_HEIGHT - 1))*/ {
+            /* TODO: || (startTiming == 3 && x == 3 && scanline >= (PPU::SCREEN_HEIGHT - 1))*/ {
             // hblank repeat ends when in vblank, vlbank repeat only runs once per blank
             dmaXEnabled[x] = false;
         }
         dmaXWordCount[x] = (uint32_t)(bus->iORegisters[Bus::IORegister::DMA0CNT_L + ioRegOffset]) |
                     ((uint32_t)(bus->iORegisters[Bus::IORegister::DMA0CNT_L + 1 + ioRegOffset]) << 8);
+        if(soundFifo) {
+            dmaXWordCount[x] = 4;
+        }
         if(destAdjust == 3) {
             dmaXDestAddr[x] = (uint32_t)(bus->iORegisters[Bus::IORegister::DMA0DAD + ioRegOffset]) |
                     ((uint32_t)(bus->iORegisters[Bus::IORegister::DMA0DAD + 1 + ioRegOffset]) << 8) | 
@@ -323,6 +283,116 @@ uint32_t DMA::dmaX(uint8_t x, bool vBlank, bool hBlank, uint16_t scanline) {
 }
 
 
+uint32_t DMA::unitsBeforeInterruption(uint8_t x) {
+    // the dma is interrupted after the unit during which an event with higher priority becomes due
+    Scheduler::Event* nextEvent = scheduler->peekNextEvent();
+    if(nextEvent == nullptr || nextEvent->eventType >= Scheduler::convertDmaValToDmaEvent(x)) {
+        return UINT32_MAX;
+    }
+    if(nextEvent->startCycle <= GameBoyAdvanceImpl::cyclesSinceStart) {
+        return 1;
+    }
+    return (nextEvent->startCycle - GameBoyAdvanceImpl::cyclesSinceStart + 1) / 2;
+}
+
+bool DMA::bulkTransfer(uint8_t x, uint32_t units, bool thirtyTwoBit, uint8_t srcAdjust, uint8_t destAdjust) {
+    // only increment / increment (copy) and fixed / increment (fill) between plain memory regions
+    bool destIncrement = destAdjust == 0 || destAdjust == 3;
+    if(!destIncrement || (srcAdjust != 0 && srcAdjust != 2)) {
+        return false;
+    }
+
+    uint32_t unitSize = thirtyTwoBit ? 4 : 2;
+    uint32_t alignMask = ~(unitSize - 1);
+    uint32_t length = units * unitSize;
+    uint32_t srcLength = srcAdjust == 0 ? length : unitSize;
+
+    const uint8_t* src = bus->getPlainMemoryForRead(dmaXSourceAddr[x] & alignMask, srcLength);
+    uint8_t* dest = bus->getPlainMemoryForWrite(dmaXDestAddr[x] & alignMask, length);
+    if(src == nullptr || dest == nullptr) {
+        return false;
+    }
+
+    if(srcAdjust == 0) {
+        if(dest > src && dest < src + length) {
+            // a forward copy unit by unit would read back what it just wrote
+            return false;
+        }
+        std::memmove(dest, src, length);
+        dmaXSourceAddr[x] += length;
+    } else {
+        uint8_t unit[4];
+        std::memcpy(unit, src, unitSize);
+        for(uint32_t i = 0; i < length; i += unitSize) {
+            std::memcpy(dest + i, unit, unitSize);
+        }
+    }
+    dmaXDestAddr[x] += length;
+    return true;
+}
+
+void DMA::transferUnit(uint8_t x, bool thirtyTwoBit, bool firstAccess, uint8_t srcAdjust, uint8_t destAdjust) {
+    Bus::CycleType cycleType = firstAccess ? Bus::CycleType::NONSEQUENTIAL : Bus::CycleType::SEQUENTIAL;
+    if(thirtyTwoBit) {
+        uint32_t value = bus->read32(dmaXSourceAddr[x] & 0xFFFFFFFC, cycleType);
+        bus->write32(dmaXDestAddr[x] & 0xFFFFFFFC, value, cycleType);
+    } else {
+        uint16_t value = bus->read16(dmaXSourceAddr[x] & 0xFFFFFFFE, cycleType);
+        bus->write16(dmaXDestAddr[x] & 0xFFFFFFFE, value, cycleType);
+    }
+
+    uint32_t offset = thirtyTwoBit ? 4 : 2;
+
+    // iterating source memory pointer
+    // (0=Increment,1=Decrement,2=Fixed,3=prohibited)
+    switch(srcAdjust) {
+        case 0: {
+            dmaXSourceAddr[x] += offset;
+            break;
+        }
+        case 1: {
+            dmaXSourceAddr[x] -= offset;
+            break;
+        }
+        case 2: {
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+
+    // iterating dest memory pointer
+    // (0=Increment,1=Decrement,2=Fixed,3=Increment/Reload)
+    switch(destAdjust) {
+        case 0:
+        case 3: {
+            dmaXDestAddr[x] += offset;
+            break;
+        }
+        case 1: {
+            dmaXDestAddr[x] -= offset;
+            break;
+        }
+        case 2: {
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+}
+
+void DMA::reset() {
+    for(int x = 0; x < 4; x++) {
+        dmaXEnabled[x] = false;
+        dmaXSourceAddr[x] = 0;
+        dmaXDestAddr[x] = 0;
+        dmaXWordCount[x] = 0;
+    }
+    inVideoCaptureMode = false;
+}
+
 void DMA::connectBus(std::shared_ptr<Bus> bus) {
     this->bus = bus;
 }
@@ -405,25 +475,32 @@ void DMA::scheduleDmaX(uint32_t x, uint8_t upperControlByte, bool immediately) {
 
         switch(startTiming) {
             case 0: {
-                scheduler->addEvent(eventType, cyclesInFuture, Scheduler::EventCondition::NULL_CONDITION, immediately);
+                scheduler->addEvent(eventType, cyclesInFuture, Scheduler::EventCondition::NULL_CONDITION, &DMA::onDmaEvent, this);
                 break;
             }
             case 1: {
-                scheduler->addEvent(eventType, 0, Scheduler::EventCondition::VBLANK_START, immediately);
+                // armed until the ppu reaches vblank, see triggerVBlankDmas()
+                if(immediately) {
+                    scheduler->addEvent(eventType, 0, Scheduler::EventCondition::VBLANK_START, &DMA::onDmaEvent, this);
+                }
                 break;
             }
             case 2: {
-                scheduler->addEvent(eventType, 0, Scheduler::EventCondition::HBLANK_START, immediately);
+                // armed until the ppu reaches hblank, see triggerHBlankDmas()
+                if(immediately) {
+                    scheduler->addEvent(eventType, 0, Scheduler::EventCondition::HBLANK_START, &DMA::onDmaEvent, this);
+                }
                 break;
             }
             case 3: {
                 // special
                 assert(x != 0);
-                if(x == 1 || x == 2) {
-                    scheduler->addEvent(eventType, cyclesInFuture, Scheduler::EventCondition::NULL_CONDITION, immediately);
-                } else {
-                    // x == 3
-                    scheduler->addEvent(eventType, cyclesInFuture, Scheduler::EventCondition::DMA3_VIDEO_MODE, immediately);
+                if((x == 1 || x == 2) && immediately) {
+                    // sound fifo dmas are armed until the apu requests data, see triggerSoundFifoDmas()
+                    scheduler->addEvent(eventType, 0, Scheduler::EventCondition::SOUND_FIFO, &DMA::onDmaEvent, this);
+                } else if(x == 3 && immediately) {
+                    // x == 3, video capture is armed like an hblank dma
+                    scheduler->addEvent(eventType, 0, Scheduler::EventCondition::DMA3_VIDEO_MODE, &DMA::onDmaEvent, this);
                 }
 
                 break;
@@ -437,6 +514,95 @@ void DMA::scheduleDmaX(uint32_t x, uint8_t upperControlByte, bool immediately) {
 }
 
 
+void DMA::triggerHBlankDmas() {
+    for(uint8_t x = 0; x < 4; x++) {
+        uint8_t upperControlByte = bus->iORegisters[Bus::IORegister::DMA0CNT_H + 1 + 0xC * x];
+        if(!(upperControlByte & 0x80)) {
+            continue;
+        }
+        uint8_t startTiming = (upperControlByte & 0x30) >> 4;
+        if(startTiming == 2) {
+            scheduler->addEvent(Scheduler::EventType(Scheduler::convertDmaValToDmaEvent(x)), 0, 
+                                Scheduler::EventCondition::HBLANK_START, &DMA::onDmaEvent, this);
+        } else if(startTiming == 3 && x == 3) {
+            scheduler->addEvent(Scheduler::EventType::DMA3, 0, 
+                                Scheduler::EventCondition::DMA3_VIDEO_MODE, &DMA::onDmaEvent, this);
+        }
+    }
+}
+
+bool DMA::isHBlankDmaArmed() {
+    for(uint8_t x = 0; x < 4; x++) {
+        uint8_t upperControlByte = bus->iORegisters[Bus::IORegister::DMA0CNT_H + 1 + 0xC * x];
+        if(!(upperControlByte & 0x80)) {
+            continue;
+        }
+        uint8_t startTiming = (upperControlByte & 0x30) >> 4;
+        if(startTiming == 2 || (startTiming == 3 && x == 3)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void DMA::triggerSoundFifoDmas(uint8_t fifoX) {
+    uint32_t fifoAddress = 0x40000A0 + 4 * fifoX;
+    for(uint8_t x = 1; x < 3; x++) {
+        uint32_t ioRegOffset = 0xC * x;
+        uint8_t upperControlByte = bus->iORegisters[Bus::IORegister::DMA0CNT_H + 1 + ioRegOffset];
+        if(!(upperControlByte & 0x80) || ((upperControlByte & 0x30) >> 4) != 3) {
+            continue;
+        }
+        uint32_t destAddress = (uint32_t)(bus->iORegisters[Bus::IORegister::DMA0DAD + ioRegOffset]) |
+                               ((uint32_t)(bus->iORegisters[Bus::IORegister::DMA0DAD + 1 + ioRegOffset]) << 8) | 
+                               ((uint32_t)(bus->iORegisters[Bus::IORegister::DMA0DAD + 2 + ioRegOffset]) << 16) | 
+                               ((uint32_t)(bus->iORegisters[Bus::IORegister::DMA0DAD + 3 + ioRegOffset]) << 24);
+        if((destAddress & internalMemMask) == fifoAddress) {
+            scheduler->addEvent(Scheduler::EventType(Scheduler::convertDmaValToDmaEvent(x)), 0, 
+                                Scheduler::EventCondition::SOUND_FIFO, &DMA::onDmaEvent, this);
+        }
+    }
+}
+
+void DMA::triggerVBlankDmas() {
+    for(uint8_t x = 0; x < 4; x++) {
+        uint8_t upperControlByte = bus->iORegisters[Bus::IORegister::DMA0CNT_H + 1 + 0xC * x];
+        if((upperControlByte & 0x80) && ((upperControlByte & 0x30) >> 4) == 1) {
+            scheduler->addEvent(Scheduler::EventType(Scheduler::convertDmaValToDmaEvent(x)), 0, 
+                                Scheduler::EventCondition::VBLANK_START, &DMA::onDmaEvent, this);
+        }
+    }
+}
+
+void DMA::onDmaEvent(void* context, Scheduler::Event* event) {
+    DMA* dma = static_cast<DMA*>(context);
+    uint8_t x = Scheduler::convertDmaTypeToDmaVal(event->eventType);
+    uint16_t currentScanline = dma->ppu->getCurrentScanline();
+    switch(event->eventCondition) {
+        case Scheduler::EventCondition::NULL_CONDITION: {
+            dma->dmaX(x, false, false, currentScanline);
+            break;
+        }
+        case Scheduler::EventCondition::SOUND_FIFO: {
+            dma->dmaX(x, false, false, currentScanline, true);
+            break;
+        }
+        case Scheduler::EventCondition::VBLANK_START: {
+            dma->dmaX(x, true, false, currentScanline);
+            break;
+        }
+        case Scheduler::EventCondition::HBLANK_START:
+        case Scheduler::EventCondition::DMA3_VIDEO_MODE: {
+            dma->dmaX(x, false, true, currentScanline);
+            break;
+        }
+    }
+}
+
 void DMA::connectScheduler(std::shared_ptr<Scheduler> scheduler) {
     this->scheduler = scheduler;
+}
+
+void DMA::connectPpu(std::shared_ptr<PPU> ppu) {
+    this->ppu = ppu;
 }
\ No newline at end of file
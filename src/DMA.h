@@ -1,9 +1,10 @@
 #include <cstdint>
 #include <memory>
+#include "Scheduler.h"
 
 class Bus;
 class ARM7TDMI;
-class Scheduler;
+class PPU;
 
 class DMA {
 
@@ -11,18 +12,38 @@ class DMA {
         void connectBus(std::shared_ptr<Bus> bus);
         void connectCpu(std::shared_ptr<ARM7TDMI> cpu);
         void connectScheduler(std::shared_ptr<Scheduler> scheduler);
+        void connectPpu(std::shared_ptr<PPU> ppu);
 
-        uint32_t dmaX(uint8_t x, bool vBlank, bool hBlank, uint16_t scanline);
+        uint32_t dmaX(uint8_t x, bool vBlank, bool hBlank, uint16_t scanline, bool soundFifo = false);
 
         void updateDmaUponWrite(uint32_t address, uint32_t value, uint8_t width);
+
+        // called by the ppu when entering hblank / vblank, schedules the dmas waiting for it
+        void triggerHBlankDmas();
+        void triggerVBlankDmas();
+        // called by the apu when sound fifo x (A = 0, B = 1) runs low
+        void triggerSoundFifoDmas(uint8_t fifoX);
+        // true if an enabled dma waits for hblank, the ppu only schedules hblank events when needed
+        bool isHBlankDmaArmed();
         bool eepromBusWidthDetected = true;
 
+        void reset();
+
     private:
         std::shared_ptr<Bus> bus;
         std::shared_ptr<ARM7TDMI> cpu;
         std::shared_ptr<Scheduler> scheduler;
+        std::shared_ptr<PPU> ppu;
 
         void scheduleDmaX(uint32_t x, uint8_t upperControlByte, bool immediately);
+        static void onDmaEvent(void* context, Scheduler::Event* event);
+
+        // number of units that can be transferred before a higher priority event interrupts dma x
+        uint32_t unitsBeforeInterruption(uint8_t x);
+        // moves a whole chunk with memmove / fill if source and destination are plain memory,
+        // returns false if the chunk has to go through the bus
+        bool bulkTransfer(uint8_t x, uint32_t units, bool thirtyTwoBit, uint8_t srcAdjust, uint8_t destAdjust);
+        void transferUnit(uint8_t x, bool thirtyTwoBit, bool firstAccess, uint8_t srcAdjust, uint8_t destAdjust);
 
         static const uint32_t internalMemMask = 0x07FFFFFF;
         static const uint32_t anyMemMask      = 0x0FFFFFFF;
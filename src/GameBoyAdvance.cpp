@@ -13,6 +13,10 @@ bool GameBoyAdvance::loadRom(std::string path) {
     return pimpl->loadRom(path);
 }
 
+void GameBoyAdvance::reset() {
+    pimpl->reset();
+}
+
 void GameBoyAdvance::enableDebugger() {
     // TODO
 } 
@@ -25,6 +29,30 @@ void GameBoyAdvance::printCpuState() {
     pimpl->printCpuState();
 } 
 
+void GameBoyAdvance::setAudioEnabled(bool enabled) {
+    pimpl->setAudioEnabled(enabled);
+}
+
+bool GameBoyAdvance::startAudioRecording(std::string wavPath) {
+    return pimpl->startAudioRecording(wavPath);
+}
+
+void GameBoyAdvance::stopAudioRecording() {
+    pimpl->stopAudioRecording();
+}
+
+void GameBoyAdvance::setRenderThreadEnabled(bool enabled) {
+    pimpl->setRenderThreadEnabled(enabled);
+}
+
+void GameBoyAdvance::setFrameSkip(int frames) {
+    pimpl->setFrameSkip(frames);
+}
+
+void GameBoyAdvance::setFrameRateLimited(bool limited) {
+    pimpl->setFrameRateLimited(limited);
+}
+
 void GameBoyAdvance::runRom() {
     pimpl->enterMainLoop();
 }
@@ -9,11 +9,15 @@
 
 #include "arm7tdmi/ARM7TDMI.h"
 #include "memory/Bus.h"
+#include "memory/RomRegistry.h"
 #include "LCD.h"
 #include "PPU.h"
 #include "Gamepad.h"
 #include "DMA.h"
 #include "Timer.h"
+#include "APU.h"
+#include "AudioStream.h"
+#include "WavWriter.h"
 #include "Debugger.h"
 
 using milliseconds = std::chrono::milliseconds;
@@ -36,10 +40,45 @@ GameBoyAdvanceImpl::GameBoyAdvanceImpl() {
     this->timer->connectBus(bus);
     bus->connectTimer(timer);
     this->timer->connectCpu(arm7tdmi);
+    this->apu = std::make_shared<APU>();
+    apu->connectBus(bus);
+    apu->connectDma(dma);
+    apu->connectTimer(timer);
+    bus->connectApu(apu);
+    timer->connectApu(apu);
+    apu->setSampleCallback(&GameBoyAdvanceImpl::onAudioSamples, this);
     this->scheduler =  std::make_shared<Scheduler>();
     dma->connectScheduler(scheduler);
+    dma->connectPpu(ppu);
     timer->connectScheduler(scheduler);
+    ppu->connectScheduler(scheduler);
+    ppu->connectCpu(arm7tdmi);
+    ppu->connectDma(dma);
+    ppu->setFrameCallback(&GameBoyAdvanceImpl::onFrameEnd, this);
     this->debugger =  std::make_shared<Debugger>();
+    reset();
+}
+
+void GameBoyAdvanceImpl::reset() {
+    cyclesSinceStart = 0;
+    scheduler->reset();
+    bus->reset();
+    dma->reset();
+    timer->reset();
+    apu->reset();
+    arm7tdmi->reset();
+    if(bus->gamePak != nullptr) {
+        arm7tdmi->initializeWithRom();
+    }
+    // schedules the first ppu line event, so has to come after the scheduler reset
+    ppu->reset();
+    skippedFrames = 0;
+    frameSkipped = false;
+
+    bus->iORegisters[Bus::IORegister::KEYINPUT] = 0xFF;
+    bus->iORegisters[Bus::IORegister::KEYINPUT + 1] = 0x03;
+    // SOUNDBIAS, normally set up by the bios
+    bus->iORegisters[Bus::IORegister::SOUNDBIAS + 1] = 0x02;
 }
 
 void GameBoyAdvanceImpl::printCpuState() {\
@@ -50,18 +89,51 @@ void GameBoyAdvanceImpl::printCpuState() {\
 
 // if rom loading successful return true, else return false
 bool GameBoyAdvanceImpl::loadRom(std::string path) { 
-    std::ifstream binFile(path, std::ios::binary);
-    if(binFile.fail()) {
+    std::shared_ptr<const RomRegistry::RomImage> rom = RomRegistry::load(path);
+    if(rom == nullptr) {
         std::cerr << "could not find file" << std::endl;
         return false;
     }
-    std::vector<uint8_t> buffer(std::istreambuf_iterator<char>(binFile), {});
     
-    bus->loadRom(buffer); 
+    bus->loadRom(rom); 
     arm7tdmi->initializeWithRom();
     return true;
 }
 
+void GameBoyAdvanceImpl::setAudioEnabled(bool enabled) {
+    audioEnabled = enabled;
+}
+
+bool GameBoyAdvanceImpl::startAudioRecording(std::string path) {
+    std::shared_ptr<WavWriter> writer = std::make_shared<WavWriter>();
+    if(!writer->open(path, APU::SAMPLE_RATE)) {
+        std::cerr << "could not open " << path << " for recording" << std::endl;
+        return false;
+    }
+    wavWriter = writer;
+    return true;
+}
+
+void GameBoyAdvanceImpl::stopAudioRecording() {
+    if(wavWriter != nullptr) {
+        wavWriter->close();
+        wavWriter = nullptr;
+    }
+}
+
+void GameBoyAdvanceImpl::setRenderThreadEnabled(bool enabled) {
+    ppu->setRenderThreadEnabled(enabled);
+}
+
+void GameBoyAdvanceImpl::setFrameSkip(int frames) {
+    assert(frames >= AUTO_FRAME_SKIP);
+    frameSkip = frames;
+}
+
+void GameBoyAdvanceImpl::setFrameRateLimited(bool limited) {
+    frameRateLimited = limited;
+}
+
 void GameBoyAdvanceImpl::testDisplay() {
     screen->initWindow();
 }
@@ -76,26 +148,16 @@ uint64_t GameBoyAdvanceImpl::getTotalCyclesElapsed() {
 
 void GameBoyAdvanceImpl::enterMainLoop() {
     screen->initWindow();
-    // add initial events
-    scheduler->addEvent(Scheduler::EventType::HBLANK, PPU::H_VISIBLE_CYCLES, Scheduler::EventCondition::NULL_CONDITION, false);
-    scheduler->addEvent(Scheduler::EventType::VBLANK, PPU::V_VISIBLE_CYCLES, Scheduler::EventCondition::NULL_CONDITION, false);
-    scheduler->addEvent(Scheduler::EventType::HBLANK_END, 0, Scheduler::EventCondition::NULL_CONDITION, false);
-    scheduler->addEvent(Scheduler::EventType::VBLANK_END, 227 * PPU::H_TOTAL, Scheduler::EventCondition::NULL_CONDITION, false);
-    bus->iORegisters[Bus::IORegister::DISPSTAT] &= (~0x1);
-    bus->iORegisters[Bus::IORegister::DISPSTAT] &= (~0x2);
-
-    uint16_t currentScanline = -1;
-    uint16_t nextScanline = 0;
-    uint64_t cyclesSinceLastScanline = 0;
+    if(audioEnabled) {
+        audioStream = std::make_shared<AudioStream>();
+        audioStream->play();
+        audioSync = true;
+    }
+
     previousTime = getCurrentTime();
-    double previous60Frame = getCurrentTime();
+    previous60Frame = getCurrentTime();
     startTimeSeconds = getCurrentTime() / 1000.0;
 
-    // TODO: initialize this somewhere else
-    bus->iORegisters[Bus::IORegister::KEYINPUT] = 0xFF;
-    bus->iORegisters[Bus::IORegister::KEYINPUT + 1] = 0x03;
-    double fps = 60.0;
-
     // STARTING MAIN EMULATION LOOP!
     while(true) {
         if(debugMode) {
@@ -130,171 +192,85 @@ void GameBoyAdvanceImpl::enterMainLoop() {
             }
         }
 
-        Scheduler::Event* nextEvent = scheduler->getNextEvent(cyclesSinceStart);
-        
-        while(nextEvent != nullptr) {
-            uint64_t eventCycles = 0;
-            switch(nextEvent->eventType) {
-                case Scheduler::EventType::DMA0: {
-                    dmaXEvent(0, nextEvent, currentScanline);
-                    break;
-                }
-                case Scheduler::EventType::DMA1: {
-                    dmaXEvent(1, nextEvent, currentScanline);             
-                    break;
-                }
-                case Scheduler::EventType::DMA2: {
-                    dmaXEvent(2, nextEvent, currentScanline);                 
-                    break;
-                }
-                case Scheduler::EventType::DMA3: {
-                    dmaXEvent(3, nextEvent, currentScanline);
-                    break;
-                }
-                case Scheduler::EventType::TIMER0: {
-                    timer->timerXOverflowEvent(0);
-                    break;
-                }
-                case Scheduler::EventType::TIMER1: {
-                    timer->timerXOverflowEvent(1);
-                    break;
-                }
-                case Scheduler::EventType::TIMER2: {
-                    timer->timerXOverflowEvent(2);
-                    break;
-                }
-                case Scheduler::EventType::TIMER3: {
-                    timer->timerXOverflowEvent(3);
-                    break;
-                }
-                case Scheduler::EventType::VBLANK: {
-                    // vblank time!
-                    // (do frame stuff)
-                    // TODO: put some of this stuff to separate methods / classes
-                    if(bus->iORegisters[Bus::IORegister::DISPSTAT] & 0x8) {
-                        arm7tdmi->queueInterrupt(ARM7TDMI::Interrupt::VBlank);
-                    }
-                    Gamepad::getInput(bus.get());
-
-                    // setting vblank flag to 1
-                    bus->iORegisters[Bus::IORegister::DISPSTAT] |= 0x1;
-
-                    frames++;
-                    
-                    while(getCurrentTime() - previousTime < 17) {
-                        usleep(500);
-                    }
-
-                    if((frames % 60) == 0) {
-                        double smoothing = 0.8;
-                        fps = fps * smoothing + ((double)60 / ((getCurrentTime() / 1000.0 - previous60Frame / 1000.0))) * (1.0 - smoothing);
-                        std::cout << "fps: " << fps << "\n";
-                        previous60Frame = previousTime;
-                    }
-
-                    previousTime = getCurrentTime();
-                    screen->drawWindow(ppu->renderCurrentScreen());  
+        scheduler->dispatchEvents();
+    }
+}
 
-                    if(sf::Keyboard::isKeyPressed(sf::Keyboard::Z)) {
-                        std::cout << "Entering DEBUG mode! Press LSHIFT to step through CPU instructions\n";
-                        debugMode = true;
-                        Debugger::stepMode = true;
-                    }
-                    // add next vblank event
-                    scheduler->addEvent(Scheduler::EventType::VBLANK, 
-                                        PPU::V_TOTAL - ((cyclesSinceStart + PPU::V_VISIBLE_CYCLES) % PPU::V_TOTAL), 
-                                        Scheduler::EventCondition::NULL_CONDITION, 
-                                        false);                    
-                    break;
-                }
-                case Scheduler::EventType::HBLANK: {      
-                    // hblank time!
-                    if(bus->iORegisters[Bus::IORegister::DISPSTAT] & 0x10) {
-                        arm7tdmi->queueInterrupt(ARM7TDMI::Interrupt::HBlank);
-                    }
-                    bus->iORegisters[Bus::IORegister::DISPSTAT] |= 0x2;
-
-                    // add next hblank event
-                    scheduler->addEvent(Scheduler::EventType::HBLANK,
-                                        PPU::H_TOTAL - ((cyclesSinceStart + PPU::H_VISIBLE_CYCLES) % PPU::H_TOTAL), 
-                                        Scheduler::EventCondition::NULL_CONDITION,
-                                        false);
-                    
-                    break;
-                }
-                case Scheduler::EventType::VBLANK_END: {
-                    bus->iORegisters[Bus::IORegister::DISPSTAT] &= (~0x1);
-                    // add next vblank end event
-                    scheduler->addEvent(Scheduler::EventType::VBLANK_END, 
-                                        PPU::V_TOTAL - (cyclesSinceStart % PPU::V_TOTAL), 
-                                        Scheduler::EventCondition::NULL_CONDITION, 
-                                        false);
-                    break;
-                }
-                case Scheduler::EventType::HBLANK_END: {
-                    ppu->renderScanline(currentScanline);
-                    // setting hblank flag to 0
-                    currentScanline += (cyclesSinceStart - cyclesSinceLastScanline) / PPU::H_TOTAL;    
-                    cyclesSinceLastScanline = cyclesSinceStart - (cyclesSinceStart % PPU::H_TOTAL);
-                    currentScanline %= 228;
-                    nextScanline = (currentScanline + 1) % 228;
-
-                    
-                    
-                    bus->iORegisters[Bus::IORegister::DISPSTAT] &= (~0x2);
-                    if(currentScanline == ((uint16_t)(bus->iORegisters[Bus::IORegister::DISPSTAT + 1]))) {
-                        // current scanline == vcount bits in DISPSTAT
-                        // set vcounter flag
-                        bus->iORegisters[Bus::IORegister::DISPSTAT] |= 0x04;
-                        if(bus->iORegisters[Bus::IORegister::DISPSTAT] & 0x20) {
-                            // if vcount irq enabled, queue the interrupt!
-                            arm7tdmi->queueInterrupt(ARM7TDMI::Interrupt::VCounterMatch);
-                        }
-                    } else {
-                        // toggle vcounter flag off
-                        bus->iORegisters[Bus::IORegister::DISPSTAT] &= (~0x04);
+void GameBoyAdvanceImpl::onFrameEnd(void* context) {
+    GameBoyAdvanceImpl* gba = static_cast<GameBoyAdvanceImpl*>(context);
+    // (do frame stuff)
+    Gamepad::getInput(gba->bus.get());
+
+    gba->frames++;
+    // hands the samples of this frame to the audio output
+    gba->apu->catchUp();
+    bool behind = gba->frameRateLimited && gba->limitFrameRate();
+
+    if((gba->frames % 60) == 0) {
+        double smoothing = 0.8;
+        gba->fps = gba->fps * smoothing + ((double)60 / ((getCurrentTime() / 1000.0 - gba->previous60Frame / 1000.0))) * (1.0 - smoothing);
+        std::cout << "fps: " << gba->fps << "\n";
+        gba->previous60Frame = gba->previousTime;
+    }
 
-                    }
+    gba->previousTime = getCurrentTime();
+    if(!gba->frameSkipped && gba->ppu->isFrameChanged()) {
+        gba->screen->drawWindow(gba->ppu->renderCurrentScreen());  
+    } else {
+        // the window keeps showing the last drawn frame
+        gba->screen->pollEvents();
+    }
+    // the frame that was just finished is complete, the lines of the next one are rendered from now on
+    gba->frameSkipped = gba->isNextFrameSkipped(behind);
+    gba->ppu->setFrameSkipped(gba->frameSkipped);
+
+    if(sf::Keyboard::isKeyPressed(sf::Keyboard::Z)) {
+        std::cout << "Entering DEBUG mode! Press LSHIFT to step through CPU instructions\n";
+        gba->debugMode = true;
+        Debugger::stepMode = true;
+    }
+}
 
-                    bus->iORegisters[Bus::IORegister::VCOUNT] = currentScanline;
-
-                    // add next hblank end event
-                    scheduler->addEvent(Scheduler::EventType::HBLANK_END, 
-                                        PPU::H_TOTAL - (cyclesSinceStart % PPU::H_TOTAL), 
-                                        Scheduler::EventCondition::NULL_CONDITION, 
-                                        false);
-                    break;
-                }
-                default: {
-                    break;
-                    //assert(false);
-                }
-            }
-            nextEvent = scheduler->getNextEvent(cyclesSinceStart);
-        }
-        
+void GameBoyAdvanceImpl::onAudioSamples(void* context, const int16_t* samples, uint32_t frameCount) {
+    GameBoyAdvanceImpl* gba = static_cast<GameBoyAdvanceImpl*>(context);
+    if(gba->audioStream != nullptr) {
+        gba->audioStream->pushSamples(samples, frameCount);
+    }
+    if(gba->wavWriter != nullptr) {
+        gba->wavWriter->write(samples, frameCount);
     }
 }
 
+bool GameBoyAdvanceImpl::limitFrameRate() {
+    if(audioSync) {
+        // the sound card clock paces the emulation, waits until the audio thread has drained
+        // the buffer down to its target latency. Less than half of it left means the emulation is late
+        bool behind = audioStream->getBufferedFrames() < AudioStream::TARGET_BUFFERED_FRAMES / 2;
+        if(audioStream->waitForBufferedFrames(AudioStream::TARGET_BUFFERED_FRAMES, milliseconds(100))) {
+            return behind;
+        }
+        DEBUGWARN("audio output stalled, limiting the frame rate by wall clock time\n");
+        audioSync = false;
+    }
 
-ARM7TDMI* GameBoyAdvanceImpl::getCpu() {
-    return arm7tdmi.get();
+    bool behind = getCurrentTime() - previousTime > 17;
+    while(getCurrentTime() - previousTime < 17) {
+        usleep(500);
+    }
+    return behind;
 }
 
-
-inline 
-void GameBoyAdvanceImpl::dmaXEvent(uint8_t x, Scheduler::Event* dmaEvent, uint16_t currentScanline) {
-    if(dmaEvent->eventCondition == Scheduler::EventCondition::NULL_CONDITION) {
-        dma->dmaX(x, false, false, currentScanline);
-    } else if(dmaEvent->eventCondition == Scheduler::EventCondition::HBLANK_START) {
-        dma->dmaX(x, false, true, currentScanline);
-    } else if(dmaEvent->eventCondition == Scheduler::EventCondition::VBLANK_START) {
-        dma->dmaX(x, true, false, currentScanline);
+bool GameBoyAdvanceImpl::isNextFrameSkipped(bool behind) {
+    bool skip;
+    if(frameSkip == AUTO_FRAME_SKIP) {
+        skip = behind && skippedFrames < MAX_AUTO_SKIPPED_FRAMES;
     } else {
-        // EventCondition == DMA3Videomode;
-        dma->dmaX(x, false, true, currentScanline);
-    }       
+        skip = skippedFrames < frameSkip;
+    }
+    skippedFrames = skip ? skippedFrames + 1 : 0;
+    return skip;
 }
 
-
-
+ARM7TDMI* GameBoyAdvanceImpl::getCpu() {
+    return arm7tdmi.get();
+}
@@ -10,6 +10,9 @@ class LCD;
 class PPU;
 class DMA;
 class Timer;
+class APU;
+class AudioStream;
+class WavWriter;
 class Debugger;
 
 
@@ -19,8 +22,24 @@ class GameBoyAdvanceImpl {
     GameBoyAdvanceImpl();
 
     bool loadRom(std::string path);
+    // puts every component back to its power on state, keeping the loaded rom
+    void reset();
     void enterMainLoop();
     void printCpuState();
+    // audio output through the sound card, has to be set before entering the main loop
+    void setAudioEnabled(bool enabled);
+    // writes everything the apu outputs to a .wav file as well
+    bool startAudioRecording(std::string path);
+    void stopAudioRecording();
+    // renders the frames on a second thread while the next one is emulated
+    void setRenderThreadEnabled(bool enabled);
+    // leaves out the rendering of frames frames after each drawn one,
+    // AUTO_FRAME_SKIP skips frames while the emulation runs behind real time
+    void setFrameSkip(int frames);
+    // without the limit the emulation runs as fast as it can, e.g. for fast forward
+    void setFrameRateLimited(bool limited);
+
+    static const int AUTO_FRAME_SKIP = -1;
 
     ARM7TDMI* getCpu();
 
@@ -33,13 +52,23 @@ class GameBoyAdvanceImpl {
     std::shared_ptr<PPU> ppu;
     std::shared_ptr<DMA> dma;
     std::shared_ptr<Timer> timer;
+    std::shared_ptr<APU> apu;
+    std::shared_ptr<AudioStream> audioStream;
+    std::shared_ptr<WavWriter> wavWriter;
     std::shared_ptr<Debugger> debugger;
     std::shared_ptr<Scheduler> scheduler;
 
     uint64_t getTotalCyclesElapsed();
     void testDisplay();
 
-    void dmaXEvent(uint8_t x, Scheduler::Event* dmaEvent, uint16_t currentScanline);
+    // ppu frame callback, context is the GameBoyAdvanceImpl
+    static void onFrameEnd(void* context);
+    // apu sample callback, context is the GameBoyAdvanceImpl
+    static void onAudioSamples(void* context, const int16_t* samples, uint32_t frameCount);
+    // blocks until it is time for the next frame, true if that time had already passed
+    bool limitFrameRate();
+    // decides if the frame that starts now is rendered
+    bool isNextFrameSkipped(bool behind);
 
     bool hBlank = false;
     bool scanlineRendered = false;
@@ -48,10 +77,23 @@ class GameBoyAdvanceImpl {
     long previousTime = 0;
     long currentTime = 0;
     long frames = 0;
+    double previous60Frame = 0.0;
+    double fps = 60.0;
     double startTimeSeconds = 0.0;
     uint64_t totalCycles= 0;
 
+    int frameSkip = 0;
+    // consecutive frames skipped so far
+    int skippedFrames = 0;
+    bool frameSkipped = false;
+    bool frameRateLimited = true;
+    // auto frame skip still shows every fifth frame when the emulation can't keep up at all
+    static const int MAX_AUTO_SKIPPED_FRAMES = 4;
+
     bool debugMode = false;
+    bool audioEnabled = true;
+    // frames are paced by the audio output as long as it keeps consuming samples
+    bool audioSync = false;
 
 };
 
@@ -75,19 +75,12 @@ void LCD::initWindow() {
     gbaWindow->display();
 }
 
-/*
-  0-4   Red Intensity   (0-31)
-  5-9   Green Intensity (0-31)
-  10-14 Blue Intensity  (0-31)
-*/
-
-void LCD::drawWindow(std::array<uint16_t, 38400>& pixelBuffer) {
+// pixels are RGBA8888 already, red in the lowest byte
+void LCD::drawWindow(std::array<uint32_t, 38400>& pixelBuffer) {
 
     for(int i = 0; i < (pixelBuffer.size() * 4); i += 4) {
-        uint16_t val = pixelBuffer[i >> 2];
-        sf::Color colour = sf::Color((val & 0x1f) << 3, /* R */
-                                     (val & 0x3E0) >> 2,  /* G */
-                                     (val & 0x7C00) >> 7, 255); /* B */
+        uint32_t val = pixelBuffer[i >> 2];
+        sf::Color colour = sf::Color(val & 0xFF, (val >> 8) & 0xFF, (val >> 16) & 0xFF, 255);
         pixels[i].color = colour;
         pixels[i + 1].color = colour;
         pixels[i + 2].color = colour;
@@ -95,26 +88,43 @@ void LCD::drawWindow(std::array<uint16_t, 38400>& pixelBuffer) {
     }    
 
     if(gbaWindow->isOpen()) {
-        while(gbaWindow->pollEvent(event)) {
-            if(event.type == sf::Event::Closed) {
-                gbaWindow->close();
-                exit(0);
-            }
-            if(event.type == sf::Event::Resized) {
-                sf::FloatRect visibleArea(0, 0, event.size.width, event.size.height);
-                sf::View view = sf::View(visibleArea);
-                gbaWindow->setView(view);
-                changeResolution(pixels, (float)event.size.width, (float)event.size.height);
-            }
-        }
-        gbaWindow->clear(sf::Color::Black);
-        gbaWindow->draw(pixels);
-        
-        gbaWindow->display();
+        handleEvents();
+        present();
     }
     
 }
 
+void LCD::pollEvents() {
+    // the pixels are only drawn again when the new window size needs them scaled
+    if(gbaWindow->isOpen() && handleEvents()) {
+        present();
+    }
+}
+
+bool LCD::handleEvents() {
+    bool resized = false;
+    while(gbaWindow->pollEvent(event)) {
+        if(event.type == sf::Event::Closed) {
+            gbaWindow->close();
+            exit(0);
+        }
+        if(event.type == sf::Event::Resized) {
+            sf::FloatRect visibleArea(0, 0, event.size.width, event.size.height);
+            sf::View view = sf::View(visibleArea);
+            gbaWindow->setView(view);
+            changeResolution(pixels, (float)event.size.width, (float)event.size.height);
+            resized = true;
+        }
+    }
+    return resized;
+}
+
+void LCD::present() {
+    gbaWindow->clear(sf::Color::Black);
+    gbaWindow->draw(pixels);
+    gbaWindow->display();
+}
+
 
 void LCD::closeWindow() {
     gbaWindow->close();
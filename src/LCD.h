@@ -6,11 +6,16 @@ class LCD {
 
     public: 
         void initWindow();
-        void drawWindow(std::array<uint16_t, 38400 /* width x height */>& pixelBuffer);
+        void drawWindow(std::array<uint32_t, 38400 /* width x height */>& pixelBuffer);
+        // keeps the window responsive while the last drawn frame stays on screen
+        void pollEvents();
         void closeWindow();
 
     private: 
         static void drawPixel();
+        // true if the window was resized
+        bool handleEvents();
+        void present();
         std::shared_ptr<sf::RenderWindow> gbaWindow;
         sf::VertexArray pixels;
         sf::Event event;
@@ -1,114 +1,335 @@
 #include "PPU.h"
 #include "memory/Bus.h"
+#include "arm7tdmi/ARM7TDMI.h"
+#include "DMA.h"
+#include "GameBoyAdvanceImpl.h"
 #include <SFML/Graphics.hpp>
 #include <utility>
 #include <algorithm>
+#include <cstring>
 #include <string>
 #include <iostream>
 #include "util/macros.h"
 #include "assert.h"
 #include <cmath>
+#include <chrono>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 PPU::PPU() {
+    reset();
+}
+
+void PPU::reset() {
+    // restarted below with a fresh copy of the memory
+    bool renderThreadWasEnabled = renderThreadEnabled;
+    if(renderThreadEnabled) {
+        stopRenderThread();
+    }
+
+    pixelBuffer.fill(0);
+    for(auto& line : bgLines) {
+        line.fill(transparentColour);
+    }
+    for(auto& lines : spriteLines) {
+        for(auto& line : lines) {
+            line.fill(transparentColour);
+        }
+    }
+    spriteLinePriorities.fill(0);
+    affineX.fill(0);
+    affineY.fill(0);
+    affineReloadPending = 0xF;
+    dirty = true;
+    tileDirty.fill(true);
+    paletteDirty = true;
+
+    catchUpScanline = 0;
+    catchUpCycle = 0;
+    frameSkipped = false;
+    lastDisplayWriteCycle = 0;
+    frameDrawn = false;
+    frameChanged = true;
+
+    // the first line event starts line 0
+    lastEventScanline = TOTAL_LINES - 1;
+    lastEventInHBlank = true;
+    lastEventCycle = 0 - (uint64_t)H_BLANK_CYCLES;
+    nextEventCycle = 0;
+    if(scheduler != nullptr) {
+        scheduleNextLineEvent(0);
+    }
 
+    if(renderThreadWasEnabled) {
+        setRenderThreadEnabled(true);
+    }
 }
 
-PPU::~PPU() {
+void PPU::onLineEvent(void* context, Scheduler::Event* event) {
+    PPU* ppu = static_cast<PPU*>(context);
+    ppu->lastEventScanline = ppu->nextEventScanline;
+    ppu->lastEventInHBlank = ppu->nextEventInHBlank;
+    ppu->lastEventCycle = event->startCycle;
+
+    if(ppu->lastEventInHBlank) {
+        ppu->enterHBlank();
+    } else {
+        ppu->enterLine(ppu->lastEventScanline);
+    }
+    ppu->scheduleNextLineEvent(0);
+}
+
+void PPU::updateLineEventScheduling() {
+    // transitions that already passed while nothing was observing them are skipped
+    scheduleNextLineEvent(std::min(nextEventCycle, GameBoyAdvanceImpl::cyclesSinceStart + 1));
+}
+
+void PPU::scheduleNextLineEvent(uint64_t earliestCycle) {
+    // walk forward from the last handled transition to the first one that has an observable effect
+    uint16_t scanline = lastEventScanline;
+    bool hBlank = lastEventInHBlank;
+    uint64_t cycle = lastEventCycle;
+    bool hBlankObserved = isHBlankObserved();
+    while(true) {
+        if(!hBlank) {
+            hBlank = true;
+            cycle += H_VISIBLE_CYCLES;
+            if(hBlankObserved && cycle >= earliestCycle) {
+                break;
+            }
+        } else {
+            hBlank = false;
+            cycle += H_BLANK_CYCLES;
+            scanline = scanline == (TOTAL_LINES - 1) ? 0 : scanline + 1;
+            if(isLineStartObserved(scanline) && cycle >= earliestCycle) {
+                break;
+            }
+        }
+    }
+
+    nextEventScanline = scanline;
+    nextEventInHBlank = hBlank;
+    nextEventCycle = cycle;
+
+    // scheduled relative to the transition itself, so that late dispatches don't drift
+    uint64_t cyclesInFuture = 0;
+    if(cycle > GameBoyAdvanceImpl::cyclesSinceStart) {
+        cyclesInFuture = cycle - GameBoyAdvanceImpl::cyclesSinceStart;
+    }
+    scheduler->addEvent(Scheduler::EventType::PPU_LINE, cyclesInFuture, Scheduler::EventCondition::NULL_CONDITION, 
+                        &PPU::onLineEvent, this);
+}
+
+bool PPU::isHBlankObserved() {
+    return (bus->iORegisters[Bus::IORegister::DISPSTAT] & 0x10) || dma->isHBlankDmaArmed();
+}
 
+bool PPU::isLineStartObserved(uint16_t scanline) {
+    // lines are rendered when something they read is written or at the latest when vblank starts at line 160,
+    // so only vblank and the vcount irq need the line start
+    if(scanline == VBLANK_START_LINE) {
+        return true;
+    }
+    return (bus->iORegisters[Bus::IORegister::DISPSTAT] & 0x20) && 
+           scanline == bus->iORegisters[Bus::IORegister::DISPSTAT + 1];
+}
+
+void PPU::enterHBlank() {
+    if(bus->iORegisters[Bus::IORegister::DISPSTAT] & 0x10) {
+        cpu->queueInterrupt(ARM7TDMI::Interrupt::HBlank);
+    }
+    dma->triggerHBlankDmas();
+}
+
+void PPU::enterLine(uint16_t scanline) {
+    if((bus->iORegisters[Bus::IORegister::DISPSTAT] & 0x20) && 
+       scanline == bus->iORegisters[Bus::IORegister::DISPSTAT + 1]) {
+        // current scanline == vcount bits in DISPSTAT and vcount irq enabled
+        cpu->queueInterrupt(ARM7TDMI::Interrupt::VCounterMatch);
+    }
+
+    if(scanline == VBLANK_START_LINE) {
+        // the frame is rendered from the start of line 227 of the previous frame on, see renderScanline.
+        // If nothing was written since the same point of the previous frame, no line of it has been rendered
+        // yet and all of them would come out the same
+        uint64_t frameStartCycle = lastEventCycle - (SCREEN_HEIGHT + 1) * H_TOTAL;
+        frameChanged = !frameDrawn || catchUpCycle > frameStartCycle || lastDisplayWriteCycle + V_TOTAL >= frameStartCycle;
+        // the rest of the frame
+        catchUpTo(lastEventCycle, frameChanged);
+        frameDrawn = !frameSkipped;
+        if(bus->iORegisters[Bus::IORegister::DISPSTAT] & 0x8) {
+            cpu->queueInterrupt(ARM7TDMI::Interrupt::VBlank);
+        }
+        if(frameCallback != nullptr) {
+            frameCallback(frameCallbackContext);
+        }
+        dma->triggerVBlankDmas();
+    }
+}
+
+void PPU::catchUp() {
+    catchUpTo(GameBoyAdvanceImpl::cyclesSinceStart, true);
+}
+
+void PPU::catchUpTo(uint64_t cycle, bool render) {
+    // nothing the lines read has changed since they started, so they render the same now
+    while(catchUpCycle <= cycle) {
+        if(render) {
+            renderScanline(catchUpScanline == 0 ? (TOTAL_LINES - 1) : catchUpScanline - 1);
+        }
+        catchUpScanline = catchUpScanline == (TOTAL_LINES - 1) ? 0 : catchUpScanline + 1;
+        catchUpCycle += H_TOTAL;
+    }
+}
+
+uint16_t PPU::getCurrentScanline() {
+    return (GameBoyAdvanceImpl::cyclesSinceStart % V_TOTAL) / H_TOTAL;
+}
+
+void PPU::updateBusToPrepareForLcdRead() {
+    // the status bits and VCOUNT are only computed when the cpu reads them
+    uint32_t frameCycle = GameBoyAdvanceImpl::cyclesSinceStart % V_TOTAL;
+    uint16_t scanline = frameCycle / H_TOTAL;
+    uint8_t status = 0;
+    if(scanline >= VBLANK_START_LINE && scanline < VBLANK_END_LINE) {
+        status |= 0x1;
+    }
+    if(frameCycle - scanline * H_TOTAL >= H_VISIBLE_CYCLES) {
+        status |= 0x2;
+    }
+    if(scanline == bus->iORegisters[Bus::IORegister::DISPSTAT + 1]) {
+        status |= 0x4;
+    }
+    bus->iORegisters[Bus::IORegister::DISPSTAT] = (bus->iORegisters[Bus::IORegister::DISPSTAT] & ~0x7) | status;
+    bus->iORegisters[Bus::IORegister::VCOUNT] = scanline;
+    bus->iORegisters[Bus::IORegister::VCOUNT + 1] = 0;
+}
+
+PPU::~PPU() {
+    if(renderThreadEnabled) {
+        stopRenderThread();
+    }
 }
 
 void PPU::renderScanline(uint16_t scanline) {
-    // TODO: explain this logic in a comment
-    if(scanline > (SCREEN_HEIGHT - 2) && scanline < 226) {
+    // called at the start of each line with the previous line number: the bgs are rendered for the next line
+    // and composited right away, the sprites are rendered one line further ahead
+    if(frameSkipped) {
         return;
     }
-    
-    if(scanline > (SCREEN_HEIGHT - 1)) {
-        // for special case where scanline == 226
-        scanlineBackDropColours[0] = getBackdropColour();
+    if((scanline + 1) % TOTAL_LINES >= SCREEN_HEIGHT && (scanline + 2) % TOTAL_LINES >= SCREEN_HEIGHT) {
+        return;
+    }
+
+    if(renderThreadEnabled) {
+        submitScanline(scanline);
     } else {
-        scanlineBackDropColours[(scanline + 1) % 228] = getBackdropColour();
+        drawScanline(scanline);
+    }
+}
+
+void PPU::drawScanline(uint16_t scanline) {
+    uint16_t bgLine = (scanline + 1) % TOTAL_LINES;
+    uint16_t spriteLine = (scanline + 2) % TOTAL_LINES;
+
+    if(paletteDirty) {
+        updatePaletteCache();
     }
 
-    uint8_t bgMode = (bus->iORegisters[Bus::DISPCNT] & 0x7);
+    uint8_t bgMode = (renderIo[Bus::DISPCNT] & 0x7);
+
+    if(spriteLine < SCREEN_HEIGHT) {
+        // the line buffer is reused from two lines earlier
+        for(auto& line : spriteLines[spriteLine & 1]) {
+            line.fill(transparentColour);
+        }
+        spriteLinePriorities[spriteLine & 1] = 0;
+        if(bgMode <= 2 || bgMode == 4) {
+            renderSprites(spriteLine);
+        }
+    }
+
+    if(bgLine >= SCREEN_HEIGHT) {
+        return;
+    }
+
+    updateAffineReferences(bgLine);
 
     switch(bgMode) {
         case 0: {
-            // render spritebuffer for [scanline+2, 159] 
-            renderSprites((scanline + 2) % 228);
-            // render bgbuffer for [scanline+1, 159]  
-            renderBg((scanline + 1) % 228);
+            renderBg(bgLine);
             break;
         }
         case 1: {
-            DEBUGWARN("in bg mode 1 unimplemented\n");
+            // bg 0 and 1 text, bg 2 rotation/scaling
+            latchLineLayers(0x7);
+            renderBgX(bgLine, 0);
+            renderBgX(bgLine, 1);
+            renderAffineBgX(2);
             break;
         }
         case 2: {
-            DEBUGWARN("in bg mode 2 unimplemented\n");
+            // bg 2 and 3 rotation/scaling
+            latchLineLayers(0xC);
+            renderAffineBgX(2);
+            renderAffineBgX(3);
+            break;
+        }
+        case 3:
+        case 4:
+        case 5: {
+            latchLineLayers(0x4);
+            renderBitmapLine(bgLine, bgMode);
+            break;
+        }
+        default: {
+            assert(false);
             break;
         }
-        /*
-            mode	width	height	bpp	size	    page-flip
-            3  	    240	    160	    16	1x12C00h	No
-            4 	    240	    160	    8	2x9600h	    Yes
-            5 	    160	    128	    16	2xA000h	    Yes
-        */
+    }
+
+    composeLine(bgLine);
+    stepAffineReferences();
+}
+
+/*
+    mode	width	height	bpp	size	    page-flip
+    3  	    240	    160	    16	1x12C00h	No
+    4 	    240	    160	    8	2x9600h	    Yes
+    5 	    160	    128	    16	2xA000h	    Yes
+*/
+void PPU::renderBitmapLine(uint16_t scanline, uint8_t bgMode) {
+    // the bitmap modes are drawn as bg 2
+    uint32_t* line = bgLines[2].data();
+    if(!(renderIo[Bus::IORegister::DISPCNT + 1] & 0x4)) {
+        return;
+    }
+    // DISPCNT bit 4 selects the page of mode 4 and 5
+    uint32_t page = (renderIo[Bus::IORegister::DISPCNT] & 0x10) ? 0xA000 : 0;
+
+    switch(bgMode) {
         case 3: {
-            // simple bitmap mode
-            for(int x = 0; x < SCREEN_WIDTH; x++) {
-                bgBuffer[scanline * SCREEN_WIDTH + x] = (bus->vRam[((scanline * SCREEN_WIDTH + x) << 1) + 1] << 8) | 
-                                                           (bus->vRam[(scanline * SCREEN_WIDTH + x) << 1]); 
-            } 
+            convertBgr555LineToRgba(line, &renderVram[scanline * SCREEN_WIDTH * 2], SCREEN_WIDTH);
             break;
         }
         case 4: {
-            // page flipping mode
-            renderSprites((scanline + 2) % 228);
-            if(!(bus->iORegisters[Bus::IORegister::DISPCNT] & 0x10)) {
-                // page 0
-                for(int x = 0; x < SCREEN_WIDTH; x++) {
-                    bgBuffer[scanline * SCREEN_WIDTH + x] = 
-                        indexBgPalette8Bpp(bus->vRam[(scanline * SCREEN_WIDTH + x)]);
-                } 
-            } else {
-                // page 1
-                for(int x = 0; x < SCREEN_WIDTH; x++) {
-                    bgBuffer[scanline * SCREEN_WIDTH + x] = 
-                        indexBgPalette8Bpp(bus->vRam[(scanline * SCREEN_WIDTH + x + 0xA000)]);
-                }   
+            const uint8_t* indices = &renderVram[page + scanline * SCREEN_WIDTH];
+            for(uint32_t x = 0; x < SCREEN_WIDTH; x++) {
+                line[x] = bgPaletteLookup[indices[x]];
             }
-
             break;
         }
         case 5: {
-            // page flipping mode
-            if(!(bus->iORegisters[Bus::IORegister::DISPCNT] & 0x10)) {
-                // page 0
-                for(int x = 0; x < SCREEN_WIDTH; x++) {
-                    if(scanline >= 128 || x >= 160) {
-                        bgBuffer[scanline * SCREEN_WIDTH + x] = indexBgPalette8Bpp(0);
-                    } else {
-                        bgBuffer[scanline * SCREEN_WIDTH + x] = (bus->vRam[((scanline * 160 + x) << 1) + 1] << 8) | 
-                                                                    (bus->vRam[(scanline * 160 + x) << 1]); 
-                    }
-                } 
-            } else {
-                // page 1
-                for(int x = 0; x < SCREEN_WIDTH; x++) {
-                    if(scanline >= 128 || x >= 160) {
-                        bgBuffer[scanline * SCREEN_WIDTH + x] = indexBgPalette8Bpp(0);
-                    } else {
-                        bgBuffer[scanline * SCREEN_WIDTH + x] = (bus->vRam[((scanline * 160 + x) << 1) + 1 + 0xA000] << 8) | 
-                                                                    (bus->vRam[((scanline * 160 + x) << 1) + 0xA000]); 
-                    }                
-                }   
+            // the frame is 160x128, the rest of the screen is transparent
+            uint32_t width = 0;
+            if(scanline < 128) {
+                width = 160;
+                convertBgr555LineToRgba(line, &renderVram[page + scanline * 160 * 2], width);
             }
-            break;
-        }
-        default: {
-            assert(false);
+            std::fill(line + width, line + SCREEN_WIDTH, transparentColour);
             break;
         }
     }
@@ -116,159 +337,467 @@ void PPU::renderScanline(uint16_t scanline) {
 
 void PPU::connectBus(std::shared_ptr<Bus> _bus) {
     this->bus = _bus;
+    useRenderMemory(false);
 }
 
+void PPU::connectCpu(std::shared_ptr<ARM7TDMI> cpu) {
+    this->cpu = cpu;
+}
 
-uint16_t PPU::getBackdropColour() {
-    return ((uint16_t)bus->paletteRam[0 << 1]) |
-           ((uint16_t)bus->paletteRam[(0 << 1) + 1] << 8);
+void PPU::connectDma(std::shared_ptr<DMA> dma) {
+    this->dma = dma;
 }
 
-uint32_t PPU::indexBgPalette8Bpp(uint8_t index) {
-    if(!index) {
-        return transparentColour;
+void PPU::connectScheduler(std::shared_ptr<Scheduler> scheduler) {
+    this->scheduler = scheduler;
+}
+
+void PPU::setFrameCallback(FrameCallback callback, void* context) {
+    frameCallback = callback;
+    frameCallbackContext = context;
+}
+
+
+uint32_t PPU::getBackdropColour() {
+    return paletteRgba[0];
+}
+
+void PPU::setDisplayWritten() {
+    // the bus renders the lines up to now before it writes, so the write is seen from the next line on
+    lastDisplayWriteCycle = GameBoyAdvanceImpl::cyclesSinceStart;
+}
+
+void PPU::setDisplayRegistersDirty(uint32_t offset, uint32_t length) {
+    setDisplayWritten();
+    // BG2X/BG2Y at 0x28-0x2F and BG3X/BG3Y at 0x38-0x3F, each is loaded again on its own
+    uint8_t reload = 0;
+    for(uint32_t i = 0; i < 4; i++) {
+        uint32_t start = 0x28 + (i >> 1) * 0x10 + (i & 1) * 4;
+        if(offset < start + 4 && offset + length > start) {
+            reload |= 1 << i;
+        }
+    }
+    if(renderThreadEnabled) {
+        affineReferencesChanged |= reload;
+        return;
+    }
+    affineReloadPending |= reload;
+}
+
+bool PPU::isFrameChanged() {
+    if(renderThreadEnabled) {
+        // the frame the render thread completed last may not have been shown yet
+        std::lock_guard<std::mutex> lock(frameMutex);
+        return completedFrames != presentedFrames;
     }
-    return ((uint16_t)bus->paletteRam[index << 1]) |
-           ((uint16_t)bus->paletteRam[(index << 1) + 1] << 8);
+    return frameChanged;
+}
+
+void PPU::setPaletteDirty() {
+    setDisplayWritten();
+    if(renderThreadEnabled) {
+        // the render thread gets the new palette with the next line
+        paletteChanged = true;
+        return;
+    }
+    paletteDirty = true;
+}
+
+void PPU::updatePaletteCache() {
+    for(uint32_t i = 0; i < 512; i++) {
+        paletteBgr555[i] = (((uint16_t)renderPalette[i << 1]) |
+                            ((uint16_t)renderPalette[(i << 1) + 1] << 8)) & 0x7FFF;
+        paletteRgba[i] = convertBgr555ToRgba(paletteBgr555[i]);
+    }
+    std::copy(paletteRgba.begin(), paletteRgba.begin() + 256, bgPaletteLookup.begin());
+    bgPaletteLookup[0] = transparentColour;
+    paletteDirty = false;
+}
+
+/*
+  0-4   Red Intensity   (0-31)
+  5-9   Green Intensity (0-31)
+  10-14 Blue Intensity  (0-31)
+*/
+uint32_t PPU::convertBgr555ToRgba(uint16_t colour) {
+    // the top bits are repeated in the low bits, so that 31 maps to 255
+    uint32_t red = colour & 0x1F;
+    uint32_t green = (colour >> 5) & 0x1F;
+    uint32_t blue = (colour >> 10) & 0x1F;
+    red = (red << 3) | (red >> 2);
+    green = (green << 3) | (green >> 2);
+    blue = (blue << 3) | (blue >> 2);
+    return red | (green << 8) | (blue << 16);
+}
+
+void PPU::convertBgr555LineToRgba(uint32_t* out, const uint8_t* colours, uint32_t pixels) {
+    uint32_t x = 0;
+#ifdef __SSE2__
+    // 8 pixels per 16 byte load, the channels are widened in 16 bit lanes and then interleaved
+    // with blue to make the 32 bit pixels
+    const __m128i channel = _mm_set1_epi16(0x1F);
+    for(; x + 8 <= pixels; x += 8) {
+        __m128i bgr555 = _mm_loadu_si128((const __m128i*)&colours[x * 2]);
+        __m128i red = _mm_and_si128(bgr555, channel);
+        __m128i green = _mm_and_si128(_mm_srli_epi16(bgr555, 5), channel);
+        __m128i blue = _mm_and_si128(_mm_srli_epi16(bgr555, 10), channel);
+        red = _mm_or_si128(_mm_slli_epi16(red, 3), _mm_srli_epi16(red, 2));
+        green = _mm_or_si128(_mm_slli_epi16(green, 3), _mm_srli_epi16(green, 2));
+        blue = _mm_or_si128(_mm_slli_epi16(blue, 3), _mm_srli_epi16(blue, 2));
+        __m128i redGreen = _mm_or_si128(red, _mm_slli_epi16(green, 8));
+        _mm_storeu_si128((__m128i*)&out[x], _mm_unpacklo_epi16(redGreen, blue));
+        _mm_storeu_si128((__m128i*)&out[x + 4], _mm_unpackhi_epi16(redGreen, blue));
+    }
+#endif
+    for(; x < pixels; x++) {
+        out[x] = convertBgr555ToRgba(colours[x * 2] | (colours[x * 2 + 1] << 8));
+    }
+}
+
+uint32_t PPU::indexBgPalette8Bpp(uint8_t index) {
+    return bgPaletteLookup[index];
 }
 
 uint32_t PPU::indexBgPalette4Bpp(uint8_t index) {
     if(!(index & 0x0F)) {
         return transparentColour;
     }
-    return ((uint16_t)bus->paletteRam[index << 1]) |
-           ((uint16_t)bus->paletteRam[(index << 1) + 1] << 8);
+    return paletteRgba[index];
 }
 
 
 uint32_t PPU::indexObjPalette4Bpp(uint8_t index) {
-    // TODO: this is just temporary
     if(!(index & 0x0F)) {
         return transparentColour;
     }
-    return ((uint16_t)bus->paletteRam[(index << 1) + 0x200]) |
-           ((uint16_t)bus->paletteRam[(index << 1) + 1 + 0x200] << 8);    
+    return paletteRgba[index + 256];
 }
 
 uint32_t PPU::indexObjPalette8Bpp(uint8_t index) {
     if(!index) {
         return transparentColour;
     }
-    return ((uint16_t)bus->paletteRam[(index << 1) + 0x200]) |
-           ((uint16_t)bus->paletteRam[(index << 1) + 1 + 0x200] << 8);    
+    return paletteRgba[index + 256];
 }
 
 void PPU::setObjectsDirty() {
+    setDisplayWritten();
+    if(renderThreadEnabled) {
+        objectsChanged = true;
+        return;
+    }
     dirty = true;
 }
 
-/*
-    06010000-06017FFF  32 KBytes OBJ Tiles
-*/
-// TODO: Maximum Number of Sprites per Line
-void PPU::renderSprites(uint16_t scanline) {
-    if(scanline > SCREEN_HEIGHT - 1) {
+bool PPU::isObjectDirty() {
+    return dirty;
+}
+
+void PPU::setVramDirty(uint32_t offset, uint32_t length) {
+    setDisplayWritten();
+    uint32_t lastTile = std::min((offset + length - 1) / 32, VRAM_TILES - 1);
+    if(renderThreadEnabled) {
+        for(uint32_t tile = offset / 32; tile <= lastTile; tile++) {
+            if(!vramTileChanged[tile]) {
+                vramTileChanged[tile] = true;
+                changedVramTiles.push_back(tile);
+            }
+        }
         return;
     }
+    for(uint32_t tile = offset / 32; tile <= lastTile; tile++) {
+        tileDirty[tile] = true;
+    }
+}
 
-    if(bus->iORegisters[Bus::IORegister::DISPCNT + 1] & 0x80) {
-        // SPRITE WINDOW SPRITE WINDOW SPRITE WINDOW!!!!!
-        scanlineObjectWindowData[scanline] = bus->iORegisters[Bus::IORegister::WINOUT + 1] & 0x3F;
+void PPU::useRenderMemory(bool own) {
+    if(own) {
+        renderIo = renderMemory->iORegisters.data();
+        renderVram = renderMemory->vRam.data();
+        renderPalette = renderMemory->paletteRam.data();
+        renderOam = renderMemory->objAttributes.data();
+    } else {
+        renderIo = bus->iORegisters.data();
+        renderVram = bus->vRam.data();
+        renderPalette = bus->paletteRam.data();
+        renderOam = bus->objAttributes.data();
     }
+    // the caches may not match the memory that is rendered from now
+    tileDirty.fill(true);
+    paletteDirty = true;
+    dirty = true;
+    // and the frame shown last may be older than the pixel buffer
+    frameDrawn = false;
+}
 
-    //spriteBuffer.fill(transparentColour);
-    // mapping mode 1 =  1d mapping, 0 = 2d mapping
-    bool oneDimMapping = bus->iORegisters[Bus::IORegister::DISPCNT] & 0x40;
-    // interate through all OAM attributes (object), from lowest priority to highest
-    // TODO: get rid of the magic numbers
-    for(int32_t address = 0x3F8; address >= 0x0; address -= 0x8) {
-        uint16_t objAttr0 = bus->objAttributes[address] | (bus->objAttributes[address + 1] << 8);
-        uint16_t objAttr1 = bus->objAttributes[address + 2] | (bus->objAttributes[address + 2 + 1] << 8);
-        uint16_t objAttr2 = bus->objAttributes[address + 4] | (bus->objAttributes[address + 4 + 1] << 8);
+void PPU::setRenderThreadEnabled(bool enabled) {
+    if(enabled == renderThreadEnabled) {
+        return;
+    }
+    if(!enabled) {
+        stopRenderThread();
+        return;
+    }
 
-        bool colorMode = objAttr0 & 0x2000; // 16 colors (4bpp) if cleared; 256 colors (8bpp) if set.
+    renderMemory = std::make_unique<RenderMemory>();
+    renderMemory->iORegisters = bus->iORegisters;
+    renderMemory->paletteRam = bus->paletteRam;
+    renderMemory->vRam = bus->vRam;
+    renderMemory->objAttributes = bus->objAttributes;
+    useRenderMemory(true);
+
+    renderCommands = std::make_unique<RingBuffer<uint8_t, RENDER_COMMAND_BUFFER_SIZE>>();
+    paletteChanged = false;
+    objectsChanged = false;
+    affineReferencesChanged = 0;
+    changedVramTiles.clear();
+    vramTileChanged.fill(false);
+    renderThreadEnabled = true;
+    renderThread = std::thread(&PPU::runRenderThread, this);
+}
 
-        uint8_t objMode = (objAttr0 & 0x0300) >> 8;
-        if(objMode == 2) {
-            // do not render this sprite
+void PPU::setFrameSkipped(bool skipped) {
+    // every line rendered after vblank started belongs to the next frame, so a change during vblank
+    // skips or draws that whole frame. The dirty flags are kept, the caches catch up once lines are drawn again
+    frameSkipped = skipped;
+}
+
+void PPU::stopRenderThread() {
+    // every line submitted before is still rendered
+    RenderCommand command = {STOP_RENDER_THREAD, false, false, 0, 0};
+    commandStaging.assign((uint8_t*)&command, (uint8_t*)&command + sizeof(command));
+    pushRenderCommand();
+    renderThread.join();
+
+    renderThreadEnabled = false;
+    useRenderMemory(false);
+    renderCommands = nullptr;
+    renderMemory = nullptr;
+}
+
+void PPU::submitScanline(uint16_t scanline) {
+    auto append = [&](const void* data, size_t length) {
+        commandStaging.insert(commandStaging.end(), (const uint8_t*)data, (const uint8_t*)data + length);
+    };
+
+    // the render thread's copy of the memory is brought up to date with everything written since the previous line
+    RenderCommand command = {scanline, paletteChanged, objectsChanged, affineReferencesChanged, 
+                             (uint32_t)changedVramTiles.size()};
+    commandStaging.clear();
+    append(&command, sizeof(command));
+    append(bus->iORegisters.data(), RENDER_IO_SIZE);
+    if(paletteChanged) {
+        append(bus->paletteRam.data(), 0x400);
+    }
+    if(objectsChanged) {
+        append(bus->objAttributes.data(), 0x400);
+    }
+    for(uint16_t tile : changedVramTiles) {
+        append(&tile, sizeof(tile));
+        append(&bus->vRam[tile * 32], 32);
+        vramTileChanged[tile] = false;
+    }
+    changedVramTiles.clear();
+    paletteChanged = false;
+    objectsChanged = false;
+    affineReferencesChanged = 0;
+
+    pushRenderCommand();
+}
+
+void PPU::pushRenderCommand() {
+    // waits while the render thread is a whole buffer behind
+    while(renderCommands->capacity() - renderCommands->size() < commandStaging.size()) {
+        std::this_thread::yield();
+    }
+    // pushed in one go, so the render thread sees either all of the command or nothing
+    renderCommands->push(commandStaging.data(), commandStaging.size());
+    if(renderThreadWaiting) {
+        std::lock_guard<std::mutex> lock(renderCommandMutex);
+        renderCommandsAvailable.notify_one();
+    }
+}
+
+void PPU::runRenderThread() {
+    while(true) {
+        RenderCommand command;
+        if(renderCommands->size() < sizeof(command)) {
+            std::unique_lock<std::mutex> lock(renderCommandMutex);
+            renderThreadWaiting = true;
+            renderCommandsAvailable.wait_for(lock, std::chrono::milliseconds(1), [&]() { 
+                return renderCommands->size() >= sizeof(command); 
+            });
+            renderThreadWaiting = false;
             continue;
         }
 
-        // to be included in spriteBuffer pixel bits 16-17 for render calclation at frame draw time
-        uint32_t drawMode = (uint32_t)(objAttr0 & 0x0C00) << 6;
+        renderCommands->pop((uint8_t*)&command, sizeof(command));
+        if(command.scanline == STOP_RENDER_THREAD) {
+            return;
+        }
+        renderCommands->pop(renderMemory->iORegisters.data(), RENDER_IO_SIZE);
+        affineReloadPending |= command.affineReload;
+        if(command.paletteIncluded) {
+            renderCommands->pop(renderMemory->paletteRam.data(), 0x400);
+            paletteDirty = true;
+        }
+        if(command.oamIncluded) {
+            renderCommands->pop(renderMemory->objAttributes.data(), 0x400);
+            dirty = true;
+        }
+        for(uint32_t i = 0; i < command.vramTiles; i++) {
+            uint16_t tile;
+            renderCommands->pop((uint8_t*)&tile, sizeof(tile));
+            renderCommands->pop(&renderMemory->vRam[tile * 32], 32);
+            tileDirty[tile] = true;
+        }
+
+        drawScanline(command.scanline);
+        if(command.scanline == SCREEN_HEIGHT - 2) {
+            // line 159 is composited, the frame is complete
+            std::lock_guard<std::mutex> lock(frameMutex);
+            completedFrame = pixelBuffer;
+            completedFrames++;
+        }
+    }
+}
 
-        uint32_t base = (objAttr2 & 0x03FF);
+const uint8_t* PPU::getDecodedTile(uint32_t tileAddress) {
+    uint32_t tile = tileAddress / 32;
+    if(tileDirty[tile]) {
+        decodeTile(tile);
+    }
+    return &decodedTiles[tile * 64];
+}
 
-        uint8_t paletteBank = (objAttr2 & 0xF000) >> 8;
-        uint8_t priority = (objAttr2 & 0x0C00) >> 10;
+void PPU::decodeTile(uint32_t tile) {
+    // lower nibble is the left pixel
+    for(uint32_t i = 0; i < 32; i++) {
+        uint8_t pixels = renderVram[tile * 32 + i];
+        decodedTiles[tile * 64 + i * 2] = pixels & 0xF;
+        decodedTiles[tile * 64 + i * 2 + 1] = pixels >> 4;
+    }
+    tileDirty[tile] = false;
+}
 
-        // [shape][size]
-        Dimension dim = spriteDimensions[(objAttr0 & 0xC000) >> 14][(objAttr1 & 0xC000) >> 14];
-        int32_t width = dim.width * 8;
-        int32_t height = dim.height * 8;
+void PPU::buildSpriteTable() {
+    for(uint32_t i = 0; i < 32; i++) {
+        uint32_t paramBaseAddr = 0x6 + i * 32;
+        affineParameters[i].pa = renderOam[paramBaseAddr + 0 * 8] | (renderOam[paramBaseAddr + 0 * 8 + 1] << 8);
+        affineParameters[i].pb = renderOam[paramBaseAddr + 1 * 8] | (renderOam[paramBaseAddr + 1 * 8 + 1] << 8);
+        affineParameters[i].pc = renderOam[paramBaseAddr + 2 * 8] | (renderOam[paramBaseAddr + 2 * 8 + 1] << 8);
+        affineParameters[i].pd = renderOam[paramBaseAddr + 3 * 8] | (renderOam[paramBaseAddr + 3 * 8 + 1] << 8);
+    }
 
-        // implementation detail
-        uint32_t priorityOffset = SCREEN_WIDTH * SCREEN_HEIGHT * priority;
-        int32_t screenXOffset = objAttr1 & 0x01FF;
-        int32_t screenYOffset = objAttr0 & 0x00FF;
+    scanlineSpriteCounts.fill(0);
+    // from lowest priority to highest, so later sprites overwrite earlier ones
+    for(int32_t i = 127; i >= 0; i--) {
+        uint32_t address = i * 8;
+        uint16_t objAttr0 = renderOam[address] | (renderOam[address + 1] << 8);
+        uint16_t objAttr1 = renderOam[address + 2] | (renderOam[address + 2 + 1] << 8);
+        uint16_t objAttr2 = renderOam[address + 4] | (renderOam[address + 4 + 1] << 8);
 
-        int16_t pa = 0x100;
-        int16_t pb = 0;
-        int16_t pc = 0;
-        int16_t pd = 0x100;
-        int32_t boundingWidth = width;
-        int32_t boundingHeight = height;
-        bool hFlip = false;
-        bool vFlip = false;
+        uint8_t objMode = (objAttr0 & 0x0300) >> 8;
+        if(objMode == 2 || (objAttr0 & 0xC000) == 0xC000) {
+            // do not render this sprite (disabled or prohibited shape)
+            continue;
+        }
 
-        if(objAttr0 & 0x100) {
+        Sprite& sprite = sprites[i];
+        sprite.affine = objAttr0 & 0x100;
+        if(!sprite.affine && (objAttr0 & 0x200)) {
+            // obj disabled
+            continue;
+        }
+
+        sprite.colorMode = objAttr0 & 0x2000; // 16 colors (4bpp) if cleared; 256 colors (8bpp) if set.
+        sprite.drawMode = (uint32_t)(objAttr0 & 0x0C00) << 14;
+        sprite.base = (objAttr2 & 0x03FF);
+        sprite.paletteBank = (objAttr2 & 0xF000) >> 8;
+        sprite.priority = (objAttr2 & 0x0C00) >> 10;
+
+        // [shape][size]
+        sprite.dim = spriteDimensions[(objAttr0 & 0xC000) >> 14][(objAttr1 & 0xC000) >> 14];
+        sprite.width = sprite.dim.width * 8;
+        sprite.height = sprite.dim.height * 8;
+        sprite.boundingWidth = sprite.width;
+        sprite.boundingHeight = sprite.height;
+        sprite.screenXOffset = objAttr1 & 0x01FF;
+        sprite.screenYOffset = objAttr0 & 0x00FF;
+        if(sprite.screenYOffset >= SCREEN_HEIGHT) {
+            sprite.screenYOffset = sprite.screenYOffset - 255;
+        }
+
+        if(sprite.affine) {
             // rotation / scaling flag (affine sprites enabled)
             if(objAttr0 & 0x200) {
-                boundingWidth *= 2;
-                boundingHeight *= 2;
+                sprite.boundingWidth *= 2;
+                sprite.boundingHeight *= 2;
             } 
-            uint32_t paramSelection = (objAttr1 & 0x3E00) >> 9;
-            uint32_t paramBaseAddr = 0x6 + paramSelection * 32;
-            pa = bus->objAttributes[paramBaseAddr + 0 * 8] | (bus->objAttributes[paramBaseAddr + 0 * 8 + 1] << 8);
-            pb = bus->objAttributes[paramBaseAddr + 1 * 8] | (bus->objAttributes[paramBaseAddr + 1 * 8 + 1] << 8);
-            pc = bus->objAttributes[paramBaseAddr + 2 * 8] | (bus->objAttributes[paramBaseAddr + 2 * 8 + 1] << 8);
-            pd = bus->objAttributes[paramBaseAddr + 3 * 8] | (bus->objAttributes[paramBaseAddr + 3 * 8 + 1] << 8);
-
+            sprite.affineIndex = (objAttr1 & 0x3E00) >> 9;
+            sprite.hFlip = false;
+            sprite.vFlip = false;
         } else {
-            if(objAttr0 & 0x200) {
-                // obj disabled
-                continue;
-            } 
+            sprite.hFlip = objAttr1 & 0x1000;
+            sprite.vFlip = objAttr1 & 0x2000;
+        }
 
-            if(objAttr1 & 0x1000) {
-                // horizontal flip
-                hFlip = true;
-            }
-            if(objAttr1 & 0x2000) {
-                // vertical flip
-                vFlip = true;
-            }
+        int32_t firstLine = std::max(sprite.screenYOffset, 0);
+        int32_t lastLine = std::min(sprite.screenYOffset + sprite.boundingHeight, (int32_t)SCREEN_HEIGHT - 1);
+        for(int32_t line = firstLine; line <= lastLine; line++) {
+            scanlineSprites[line][scanlineSpriteCounts[line]++] = i;
         }
+    }
+    dirty = false;
+}
 
-        int32_t halfWidth = boundingWidth / 2;
-        int32_t halfHeight = boundingHeight / 2;
+/*
+    06010000-06017FFF  32 KBytes OBJ Tiles
+*/
+// TODO: Maximum Number of Sprites per Line
+void PPU::renderSprites(uint16_t scanline) {
+    if(scanline > SCREEN_HEIGHT - 1) {
+        return;
+    }
 
-        if(screenYOffset >= SCREEN_HEIGHT) {
-            screenYOffset = screenYOffset - 255;
-        }
+    if(!(renderIo[Bus::IORegister::DISPCNT + 1] & 0x10)) {
+        // obj layer disabled
+        return;
+    }
 
-        int32_t y = (int32_t)scanline - screenYOffset - halfHeight;
+    if(dirty) {
+        buildSpriteTable();
+    }
 
-        int32_t screenY = scanline;
-    
-        if((y + halfHeight) < 0 || boundingHeight < (y + halfHeight)) {
-            // sprite outside scanline, doesnt need to be rendered
-            continue;
+    // mapping mode 1 =  1d mapping, 0 = 2d mapping
+    bool oneDimMapping = renderIo[Bus::IORegister::DISPCNT] & 0x40;
+    // only the sprites that cover this scanline
+    for(uint32_t i = 0; i < scanlineSpriteCounts[scanline]; i++) {
+        const Sprite& sprite = sprites[scanlineSprites[scanline][i]];
+        spriteLinePriorities[scanline & 1] |= 1 << sprite.priority;
+        uint32_t* line = spriteLines[scanline & 1][sprite.priority].data();
+
+        int16_t pa = 0x100;
+        int16_t pb = 0;
+        int16_t pc = 0;
+        int16_t pd = 0x100;
+        if(sprite.affine) {
+            pa = affineParameters[sprite.affineIndex].pa;
+            pb = affineParameters[sprite.affineIndex].pb;
+            pc = affineParameters[sprite.affineIndex].pc;
+            pd = affineParameters[sprite.affineIndex].pd;
         }
 
+        int32_t width = sprite.width;
+        int32_t height = sprite.height;
+
+        int32_t halfWidth = sprite.boundingWidth / 2;
+        int32_t halfHeight = sprite.boundingHeight / 2;
+        int32_t y = (int32_t)scanline - sprite.screenYOffset - halfHeight;
+
         for(int32_t x = -halfWidth; x < halfWidth; x++) {
             
-            int32_t screenX = x + screenXOffset + halfWidth;
+            int32_t screenX = x + sprite.screenXOffset + halfWidth;
 
             screenX &= 0x1FF;
 
@@ -282,10 +811,10 @@ void PPU::renderSprites(uint16_t scanline) {
             int32_t textureX = ((pa * x + pb * y) >> 8) + (width / 2);
             int32_t textureY = ((pc * x + pd * y) >> 8) + (height / 2);
 
-            if(hFlip) {
+            if(sprite.hFlip) {
                 textureX = width - textureX - 1;
             }
-            if(vFlip) {
+            if(sprite.vFlip) {
                 textureY = height - textureY - 1;
             }
 
@@ -294,37 +823,33 @@ void PPU::renderSprites(uint16_t scanline) {
                 continue;
             }
 
-            if(colorMode) {
+            if(sprite.colorMode) {
 
                 // 8 bpp
-                uint32_t tileNum = oneDimMapping ? base + ((textureY / 8) * dim.width + (textureX / 8)) * 2 :
-                            base + ((textureY / 8) * 32 + (textureX / 8)) * 2;
+                uint32_t tileNum = oneDimMapping ? sprite.base + ((textureY / 8) * sprite.dim.width + (textureX / 8)) * 2 :
+                            sprite.base + ((textureY / 8) * 32 + (textureX / 8)) * 2;
 
                 tileNum &= 0x3FF;
                 tileAddress = 0x10000 + tileNum * 0x20; 
             } else {
 
                 // 4 bpp
-                uint32_t tileNum = oneDimMapping ? base + ((textureY / 8) * dim.width + (textureX / 8)):
-                            base + ((textureY / 8) * 32 + (textureX / 8));
+                uint32_t tileNum = oneDimMapping ? sprite.base + ((textureY / 8) * sprite.dim.width + (textureX / 8)):
+                            sprite.base + ((textureY / 8) * 32 + (textureX / 8));
 
                 tileNum &= 0x3FF;
                 tileAddress = 0x10000 + tileNum * 0x20; 
             }    
 
 
-            if(colorMode) {
-                colour = indexObjPalette8Bpp(bus->vRam[tileAddress + (textureY % 8) * 8 + (textureX % 8)]);
+            if(sprite.colorMode) {
+                colour = indexObjPalette8Bpp(renderVram[tileAddress + (textureY % 8) * 8 + (textureX % 8)]);
             } else {
-                if(textureX % 2) {
-                    colour = indexObjPalette4Bpp(((bus->vRam[tileAddress + (((textureY % 8) * 8 + (textureX % 8)) >> 1)] & 0xF0) >> 4) | paletteBank); 
-                } else {
-                    colour = indexObjPalette4Bpp((bus->vRam[tileAddress + (((textureY % 8) * 8 + (textureX % 8)) >> 1)] & 0xF) | paletteBank);
-                }
+                colour = indexObjPalette4Bpp(getDecodedTile(tileAddress)[(textureY % 8) * 8 + (textureX % 8)] | sprite.paletteBank);
             }
 
             if(colour != transparentColour) {
-                spriteBuffer[priorityOffset + screenY * SCREEN_WIDTH + screenX] = colour | drawMode;
+                line[screenX] = colour | sprite.drawMode;
             }
         
         }
@@ -334,40 +859,50 @@ void PPU::renderSprites(uint16_t scanline) {
 
 
 void PPU::renderBg(uint16_t scanline) {
-    if(scanline > (SCREEN_HEIGHT - 1)) {
-        scanline = 0;
+    latchLineLayers(0xF);
+
+    renderBgX(scanline, 0);
+    renderBgX(scanline, 1);
+    renderBgX(scanline, 2);
+    renderBgX(scanline, 3);
+}
+
+
+void PPU::latchLineLayers(uint8_t bgEnableMask) {
+    lineBgEnabled = renderIo[Bus::IORegister::DISPCNT + 1] & bgEnableMask;
+    lineBgPriorities = 0;
+    for(uint32_t bg = 0; bg < 4; bg++) {
+        lineBgPriorities |= (renderIo[0x8 + bg * 2] & 0x3) << (bg * 2);
     }
 
-    if(bus->iORegisters[Bus::IORegister::DISPCNT + 1] & 0xE0) {
+    lineWindows[0].enabled = false;
+    lineWindows[1].enabled = false;
+    if(renderIo[Bus::IORegister::DISPCNT + 1] & 0xE0) {
         // WINDOWING WINDOWING WINDOWING
-        if(bus->iORegisters[Bus::IORegister::DISPCNT + 1] & 0x20) {
+        if(renderIo[Bus::IORegister::DISPCNT + 1] & 0x20) {
             // window 0
-            scanlineBgWindowData[scanline].enabled = true;
-            scanlineBgWindowData[scanline].bottom = bus->iORegisters[Bus::IORegister::WIN0V];
-            scanlineBgWindowData[scanline].top = (bus->iORegisters[Bus::IORegister::WIN0V + 1]);
-            scanlineBgWindowData[scanline].right = bus->iORegisters[Bus::IORegister::WIN0H];
-            scanlineBgWindowData[scanline].left = bus->iORegisters[Bus::IORegister::WIN0H + 1];
-            scanlineBgWindowData[scanline].metaData = bus->iORegisters[Bus::IORegister::WININ] & 0x3F;
-        }
-        if(bus->iORegisters[Bus::IORegister::DISPCNT + 1] & 0x40) {
+            lineWindows[0].enabled = true;
+            lineWindows[0].bottom = renderIo[Bus::IORegister::WIN0V];
+            lineWindows[0].top = (renderIo[Bus::IORegister::WIN0V + 1]);
+            lineWindows[0].right = renderIo[Bus::IORegister::WIN0H];
+            lineWindows[0].left = renderIo[Bus::IORegister::WIN0H + 1];
+            lineWindows[0].metaData = renderIo[Bus::IORegister::WININ] & 0x3F;
+        }
+        if(renderIo[Bus::IORegister::DISPCNT + 1] & 0x40) {
             // window 1
-            scanlineBgWindowData[SCREEN_HEIGHT + scanline].enabled = true;
-            scanlineBgWindowData[SCREEN_HEIGHT + scanline].bottom = bus->iORegisters[Bus::IORegister::WIN1V];
-            scanlineBgWindowData[SCREEN_HEIGHT + scanline].top = (bus->iORegisters[Bus::IORegister::WIN1V + 1]);
-            scanlineBgWindowData[SCREEN_HEIGHT + scanline].right = bus->iORegisters[Bus::IORegister::WIN1H];
-            scanlineBgWindowData[SCREEN_HEIGHT + scanline].left = bus->iORegisters[Bus::IORegister::WIN1H + 1];
-            scanlineBgWindowData[SCREEN_HEIGHT + scanline].metaData = bus->iORegisters[Bus::IORegister::WININ + 1] & 0x3F;
+            lineWindows[1].enabled = true;
+            lineWindows[1].bottom = renderIo[Bus::IORegister::WIN1V];
+            lineWindows[1].top = (renderIo[Bus::IORegister::WIN1V + 1]);
+            lineWindows[1].right = renderIo[Bus::IORegister::WIN1H];
+            lineWindows[1].left = renderIo[Bus::IORegister::WIN1H + 1];
+            lineWindows[1].metaData = renderIo[Bus::IORegister::WININ + 1] & 0x3F;
         }  
-        scanlineOutsideWindowData[scanline] = bus->iORegisters[Bus::IORegister::WINOUT] & 0x3F;
+        lineOutsideWindowData = renderIo[Bus::IORegister::WINOUT] & 0x3F;
+        // SPRITE WINDOW SPRITE WINDOW SPRITE WINDOW!!!!!
+        lineObjectWindowData = renderIo[Bus::IORegister::WINOUT + 1] & 0x3F;
     }
-
-    renderBgX(scanline, 0);
-    renderBgX(scanline, 1);
-    renderBgX(scanline, 2);
-    renderBgX(scanline, 3);
 }
 
-
 /*
   BGXCNT
   Bit   Expl.
@@ -382,126 +917,175 @@ void PPU::renderBg(uint16_t scanline) {
   14-15 Screen Size (0-3)
 */
 void PPU::renderBgX(uint16_t scanline, uint8_t x) {
-    if(!(bus->iORegisters[Bus::IORegister::DISPCNT + 1] & (1 << x))) {
+    if(!(renderIo[Bus::IORegister::DISPCNT + 1] & (1 << x))) {
         // check if x screen enabled
         return;
     }
 
-    uint16_t bgCnt = bus->iORegisters[0x8 + x * 2] | (bus->iORegisters[0x8 + x * 2 + 1] << 8);
-    uint8_t priority = bgCnt & 0x3;
-    uint32_t bgBufferOffset = x * SCREEN_HEIGHT * SCREEN_WIDTH;
-    uint8_t tileBaseBlock = (bgCnt & 0xC) >> 2;
-    uint8_t screenBaseBlock = (bgCnt & 0x1F00) >> 8;
-    uint8_t size = (bgCnt & 0xC000) >> 14;
-    Dimension bgDim = textBgDimensions[size];
-    uint8_t width = bgDim.width;
-    uint8_t height = bgDim.height; 
-
-    uint16_t hOffset =  (bus->iORegisters[0x10 + x * 4] | 
-                        (bus->iORegisters[0x10 + x * 4 + 1] << 8)) & 0x1FF;
-    uint16_t vOffset =  (bus->iORegisters[0x12 + x * 4] | 
-                        (bus->iORegisters[0x12 + x * 4 + 1] << 8)) & 0x1FF;
-
-    uint32_t screenX = 0;
-    uint32_t screenY = 0;
-
+    uint16_t bgCnt = renderIo[0x8 + x * 2] | (renderIo[0x8 + x * 2 + 1] << 8);
+    uint32_t tileBase = ((bgCnt & 0xC) >> 2) * 0x4000;
+    uint32_t screenBase = ((bgCnt & 0x1F00) >> 8) * 0x800;
+    Dimension bgDim = textBgDimensions[(bgCnt & 0xC000) >> 14];
+    // map sizes are powers of two, so the wraparound is a mask
+    uint32_t widthMask = bgDim.width * 8 - 1;
+    uint32_t heightMask = bgDim.height * 8 - 1;
     bool colorMode = bgCnt & 0x0080;
 
-    uint32_t tileWidth = colorMode ? 64 : 32;
-
-    int16_t pa = 1;
-    int16_t pb = 0;
-    int16_t pc = 1;
-    int16_t pd = 0;
-
-    for(uint8_t x = 0; x < width; x++) {
-        uint8_t screenBlockX = x / 32;
-        for(uint8_t y = 0; y < height; y++) {
-            /*
-                In 'Text Modes', the screen size is organized as follows: 
-                The screen consists of one or more 256x256 pixel (32x32 tiles) areas. 
-                When Size=0: only 1 area (SC0), 
-                when Size=1 or Size=2: two areas (SC0,SC1 either horizontally or vertically arranged next to each other), 
-                when Size=3: four areas (SC0,SC1 in upper row, SC2,SC3 in lower row). 
-                Whereas SC0 is defined by the normal BG Map base address 
-                (Bit 8-12 of BGxCNT), SC1 uses same address +2K, SC2 address +4K, SC3 address +6K. 
-                When the screen is scrolled it'll always wraparound.
-            */
-            uint8_t screenBlockY = y / 32;
-            uint8_t screenBlock = (screenBlockX + screenBlockY * (width / 32));
-
-            uint32_t addr = (((y % 32) * 32) + (x % 32)) * 2 + (screenBaseBlock + screenBlock) * 0x800;
-            
-            uint16_t screenEntry = ((uint16_t)bus->vRam[addr]) | 
-                                  ((uint16_t)(bus->vRam[addr + 1] << 8));
-
+    uint16_t hOffset =  (renderIo[0x10 + x * 4] | 
+                        (renderIo[0x10 + x * 4 + 1] << 8)) & 0x1FF;
+    uint16_t vOffset =  (renderIo[0x12 + x * 4] | 
+                        (renderIo[0x12 + x * 4 + 1] << 8)) & 0x1FF;
+
+    /*
+        In 'Text Modes', the screen size is organized as follows: 
+        The screen consists of one or more 256x256 pixel (32x32 tiles) areas. 
+        When Size=0: only 1 area (SC0), 
+        when Size=1 or Size=2: two areas (SC0,SC1 either horizontally or vertically arranged next to each other), 
+        when Size=3: four areas (SC0,SC1 in upper row, SC2,SC3 in lower row). 
+        Whereas SC0 is defined by the normal BG Map base address 
+        (Bit 8-12 of BGxCNT), SC1 uses same address +2K, SC2 address +4K, SC3 address +6K. 
+        When the screen is scrolled it'll always wraparound.
+    */
+    uint32_t mapY = (scanline + vOffset) & heightMask;
+    uint32_t mapRowAddress = screenBase + (mapY / 256) * (bgDim.width / 32) * 0x800 + ((mapY / 8) % 32) * 64;
+    uint32_t tileRow = mapY % 8;
+
+    // only the map entries crossing this scanline are fetched, left to right
+    uint32_t* line = bgLines[x].data();
+    uint32_t mapX = hOffset & widthMask;
+    uint32_t screenX = 0;
+    while(screenX < SCREEN_WIDTH) {
+        uint32_t addr = mapRowAddress + (mapX / 256) * 0x800 + ((mapX / 8) % 32) * 2;
+        uint16_t screenEntry = ((uint16_t)renderVram[addr]) | 
+                              ((uint16_t)(renderVram[addr + 1] << 8));
+
+        bool hFlip = screenEntry & 0x0400;
+        uint32_t row = (screenEntry & 0x0800) ? 7 - tileRow : tileRow;
+        uint32_t firstPixel = mapX % 8;
+        uint32_t pixels = std::min(8 - firstPixel, SCREEN_WIDTH - screenX);
+
+        uint32_t tileAddress = tileBase + (screenEntry & 0x3FF) * (colorMode ? 64 : 32);
+        if(tileAddress >= 0x10000) {
+            // bg tiles can't be fetched from OBJ VRAM
+            for(uint32_t pixel = 0; pixel < pixels; pixel++) {
+                line[screenX++] = transparentColour;
+            }
+            mapX = (mapX + pixels) & widthMask;
+            continue;
+        }
 
-            int8_t hFlipMultiplier = 1;
-            int8_t hFlipOffset = 0;
-            int8_t vFlipMultiplier = 1;
-            int8_t vFlipOffset = 0;
+        // the 8 palette indices of the tile row in one load, leftmost pixel in the lowest byte.
+        // 8bpp tiles are stored like that already, 4bpp tiles come from the decoded tile cache
+        uint64_t rowPixels;
+        if(colorMode) {
+            memcpy(&rowPixels, &renderVram[tileAddress + row * 8], 8);
+        } else {
+            memcpy(&rowPixels, getDecodedTile(tileAddress) + row * 8, 8);
+        }
+        if(hFlip) {
+            rowPixels = __builtin_bswap64(rowPixels);
+        }
+        rowPixels >>= firstPixel * 8;
 
-            if(screenEntry & 0x0400) {
-                // hFlip
-                hFlipMultiplier = -1;
-                hFlipOffset = 7;
+        if(colorMode) {
+            for(uint32_t pixel = 0; pixel < pixels; pixel++) {
+                line[screenX++] = indexBgPalette8Bpp(rowPixels & 0xFF);
+                rowPixels >>= 8;
             }
-            if(screenEntry & 0x0800) {
-                // vFlip
-                vFlipMultiplier = -1;
-                vFlipOffset = 7;
+        } else {
+            uint8_t paletteBank = (screenEntry & 0xF000) >> 8;
+            for(uint32_t pixel = 0; pixel < pixels; pixel++) {
+                line[screenX++] = indexBgPalette4Bpp((rowPixels & 0xFF) | paletteBank);
+                rowPixels >>= 8;
             }
+        }
+        mapX = (mapX + pixels) & widthMask;
+    }
+}
 
-            // first check if this tile will be rendered
-            screenY = ((uint32_t)(y * 8 + (vFlipOffset + vFlipMultiplier * 0)) - vOffset) % ((uint32_t)height * 8);
-            if((screenY + 7) < scanline) {continue;}
-
-            uint8_t paletteBank = (screenEntry & 0xF000) >> 8;
+void PPU::updateAffineReferences(uint16_t scanline) {
+    if(scanline == 0) {
+        affineReloadPending = 0xF;
+    }
+    for(uint32_t bg = 0; bg < 2; bg++) {
+        // 28 bit signed
+        uint32_t reference;
+        if(affineReloadPending & (1 << (bg * 2))) {
+            memcpy(&reference, &renderIo[0x28 + bg * 0x10], 4);
+            affineX[bg] = (int32_t)(reference << 4) >> 4;
+        }
+        if(affineReloadPending & (2 << (bg * 2))) {
+            memcpy(&reference, &renderIo[0x2C + bg * 0x10], 4);
+            affineY[bg] = (int32_t)(reference << 4) >> 4;
+        }
+    }
+    affineReloadPending = 0;
+}
 
-            uint32_t tileIndex = screenEntry & 0x3FF;
-            uint32_t offset = ((uint32_t)tileBaseBlock) * 0x4000 + tileIndex * tileWidth; // TODO: or 64 if in 8bpp mode
-
-            for(uint8_t tileY = 0; tileY < 8; tileY++) {
-                screenY = (((uint32_t)y * 8 + (vFlipOffset + vFlipMultiplier * tileY)) - vOffset) % ((uint32_t)height * 8);
-
-                if(screenY != scanline) {
-                    continue;
-                }
-                for(uint8_t tileX = 0; tileX < 8; tileX++) {
-                    screenX = (((uint32_t)x * 8 + (hFlipOffset + hFlipMultiplier * tileX)) - hOffset) % ((uint32_t)width * 8);
-                    
-                    if(screenX >= SCREEN_WIDTH || screenY >= SCREEN_HEIGHT) {
-                        continue;
-                    }
-                    
-                    if(colorMode) {
-                        bgBuffer[bgBufferOffset + screenY * SCREEN_WIDTH + screenX] = 
-                            indexBgPalette8Bpp(bus->vRam[offset + tileY * 8 + tileX]) | ((uint32_t)priority << 16);
-                   } else {
-                        if(tileX % 2) {
-                            // tile x odd
-                            // TODO: clean this up...
-                            bgBuffer[bgBufferOffset + screenY * SCREEN_WIDTH + screenX] = 
-                                indexBgPalette4Bpp(((bus->vRam[offset + ((tileY * 8 + tileX) / 2)] & 0xF0) >> 4) | paletteBank) | 
-                                ((uint32_t)priority << 16);
-                        } else {
-                            // tile x even
-                            bgBuffer[bgBufferOffset + screenY * SCREEN_WIDTH + screenX] = 
-                                indexBgPalette4Bpp((bus->vRam[offset + ((tileY * 8 + tileX) / 2)] & 0xF) | paletteBank) |
-                                ((uint32_t)priority << 16);
-                        }                    
-                    }
-
-                }
-                if(screenY == scanline) break;
-            }
-            if(screenY == scanline) break;           
-        } 
-    } 
+void PPU::stepAffineReferences() {
+    // the internal registers keep counting in every mode
+    for(uint32_t bg = 0; bg < 2; bg++) {
+        int16_t pb;
+        int16_t pd;
+        memcpy(&pb, &renderIo[0x22 + bg * 0x10], 2);
+        memcpy(&pd, &renderIo[0x26 + bg * 0x10], 2);
+        // the sum is truncated to 28 bits like the registers
+        affineX[bg] = (int32_t)((uint32_t)(affineX[bg] + pb) << 4) >> 4;
+        affineY[bg] = (int32_t)((uint32_t)(affineY[bg] + pd) << 4) >> 4;
+    }
 }
 
-bool PPU::isTransparent(uint32_t pixelData) {
-    return pixelData & transparentColour;
+/*
+    Rotation/scaling bgs: the map has one byte (the tile number) per tile and the tiles are always 8bpp.
+    The map coordinate of a pixel is the reference point of the line plus x * (PA, PC), so it is stepped
+    along the line instead of multiplying the matrix out per pixel.
+*/
+void PPU::renderAffineBgX(uint8_t x) {
+    if(!(renderIo[Bus::IORegister::DISPCNT + 1] & (1 << x))) {
+        return;
+    }
+
+    uint16_t bgCnt = renderIo[0x8 + x * 2] | (renderIo[0x8 + x * 2 + 1] << 8);
+    uint32_t tileBase = ((bgCnt & 0xC) >> 2) * 0x4000;
+    uint32_t screenBase = ((bgCnt & 0x1F00) >> 8) * 0x800;
+    // 128, 256, 512 or 1024 pixels square
+    uint32_t sizeShift = 7 + ((bgCnt & 0xC000) >> 14);
+    uint32_t sizeMask = (1 << sizeShift) - 1;
+    bool wraparound = bgCnt & 0x2000;
+
+    int16_t pa;
+    int16_t pc;
+    memcpy(&pa, &renderIo[0x20 + (x - 2) * 0x10], 2);
+    memcpy(&pc, &renderIo[0x24 + (x - 2) * 0x10], 2);
+
+    // the map coordinates of the whole line first, this loop vectorises
+    alignas(16) std::array<int32_t, SCREEN_WIDTH> mapX;
+    alignas(16) std::array<int32_t, SCREEN_WIDTH> mapY;
+    int32_t referenceX = affineX[x - 2];
+    int32_t referenceY = affineY[x - 2];
+    for(int32_t screenX = 0; screenX < (int32_t)SCREEN_WIDTH; screenX++) {
+        mapX[screenX] = (referenceX + pa * screenX) >> 8;
+        mapY[screenX] = (referenceY + pc * screenX) >> 8;
+    }
+    if(wraparound) {
+        for(uint32_t screenX = 0; screenX < SCREEN_WIDTH; screenX++) {
+            mapX[screenX] &= sizeMask;
+            mapY[screenX] &= sizeMask;
+        }
+    }
+
+    uint32_t* line = bgLines[x].data();
+    for(uint32_t screenX = 0; screenX < SCREEN_WIDTH; screenX++) {
+        uint32_t pixelX = mapX[screenX];
+        uint32_t pixelY = mapY[screenX];
+        if((pixelX | pixelY) > sizeMask) {
+            // outside of the map without wraparound, negative coordinates included
+            line[screenX] = transparentColour;
+            continue;
+        }
+        uint8_t tile = renderVram[screenBase + ((pixelY >> 3) << (sizeShift - 3)) + (pixelX >> 3)];
+        line[screenX] = indexBgPalette8Bpp(renderVram[tileBase + tile * 64 + (pixelY & 7) * 8 + (pixelX & 7)]);
+    }
 }
 
 PPU::Coords PPU::convertScreenCoordsToSpriteCoords(int32_t screenX, int32_t screenY, int16_t pa, int16_t pb, int16_t pc, int16_t pd, int32_t xRotCentre, int32_t yRotCentre) {
@@ -525,118 +1109,111 @@ PPU::Coords PPU::convertScreenCoordsToSpriteCoords(int32_t screenX, int32_t scre
 }
 
 
-// this is only called once per frame
-std::array<uint16_t, PPU::SCREEN_WIDTH * PPU::SCREEN_HEIGHT>& PPU::renderCurrentScreen() {
-    pixelBuffer.fill(0);
-    // get the priorities of the backgrounds
-    std::vector<std::pair<uint8_t, uint8_t>> bgPriorities;
-    bgPriorities.push_back({(bgBuffer[0 * SCREEN_WIDTH * SCREEN_HEIGHT] & 0x30000) >> 16, 0});
-    bgPriorities.push_back({(bgBuffer[1 * SCREEN_WIDTH * SCREEN_HEIGHT] & 0x30000) >> 16, 1});
-    bgPriorities.push_back({(bgBuffer[2 * SCREEN_WIDTH * SCREEN_HEIGHT] & 0x30000) >> 16, 2});
-    bgPriorities.push_back({(bgBuffer[3 * SCREEN_WIDTH * SCREEN_HEIGHT] & 0x30000) >> 16, 3});
-    std::sort(bgPriorities.begin(), bgPriorities.end());
-    // because going from lowest (3) to highest (0) prioirty
+// this is only called once per frame, the lines are composited as they are rendered
+std::array<uint32_t, PPU::SCREEN_WIDTH * PPU::SCREEN_HEIGHT>& PPU::renderCurrentScreen() {
+    if(renderThreadEnabled) {
+        // the render thread may still be drawing this frame, so the last complete one is shown
+        std::lock_guard<std::mutex> lock(frameMutex);
+        presentedFrame = completedFrame;
+        presentedFrames = completedFrames;
+        return presentedFrame;
+    }
+    return pixelBuffer;
+}
+
+void PPU::composeLine(uint16_t scanline) {
+
+    // back to front: from the lowest priority to the highest, within a priority the bgs from bg3 to bg0.
     // In case that the 'Priority relative to BG' is the same than the priority of one of the background layers, 
-    // then the OBJ becomes higher priority and is displayed on top of that BG layer.   
-
-    bool win0Enabled = false;
-    bool win1Enabled = false;
-
-
-    for(int y = 0; y < SCREEN_HEIGHT; y++) {
-        uint8_t windowBgMask;
-        uint8_t window0Left = 0;
-        uint8_t window0Right = 0;
-        uint8_t window1Left = 0;
-        uint8_t window1Right = 0;
-        bool window0 = false;
-        bool window1 = false;
-        bool windowed = false;
-        if(scanlineBgWindowData[y].enabled) {
-            windowed = true;
-            // WINDOW 0
-            if((scanlineBgWindowData[y].top <= y && y < scanlineBgWindowData[y].bottom) || 
-               ((int8_t)scanlineBgWindowData[y].top <= y && y < (int8_t)scanlineBgWindowData[y].bottom)) {
-                window0 = true;
-                window0Left = scanlineBgWindowData[y].left;
-                window0Right = scanlineBgWindowData[y].right;
+    // then the OBJ becomes higher priority and is displayed on top of that BG layer.
+    const uint32_t* layerLines[8];
+    uint32_t layerWindowBits[8];
+    uint32_t layerCount = 0;
+    for(int32_t priority = 3; priority >= 0; priority--) {
+        for(int32_t bg = 3; bg >= 0; bg--) {
+            if((lineBgEnabled & (1 << bg)) && ((lineBgPriorities >> (bg * 2)) & 0x3) == priority) {
+                layerLines[layerCount] = bgLines[bg].data();
+                layerWindowBits[layerCount] = 1 << bg;
+                layerCount++;
             }
         }
-        if(scanlineBgWindowData[SCREEN_HEIGHT + y].enabled) {
-            windowed = true;
-            // WINDOW 1
-            if((scanlineBgWindowData[SCREEN_HEIGHT + y].top <= y && y < scanlineBgWindowData[SCREEN_HEIGHT + y].bottom) || 
-               ((int8_t)scanlineBgWindowData[SCREEN_HEIGHT + y].top <= y && y < (int8_t)scanlineBgWindowData[SCREEN_HEIGHT + y].bottom)) {
-                window1 = true;
-                window1Left = scanlineBgWindowData[SCREEN_HEIGHT + y].left;
-                window1Right = scanlineBgWindowData[SCREEN_HEIGHT + y].right;
-            }         
-        }
-
-        for(int x = 0; x < SCREEN_WIDTH; x++) {
-            pixelBuffer[y * SCREEN_WIDTH + x] = scanlineBackDropColours[y];
-
-            for(int priority = 3; priority >= 0; priority--) {
-                uint32_t bgOffset = (bgPriorities[priority].second) * SCREEN_HEIGHT * SCREEN_WIDTH;
-                uint32_t bgPixel = bgBuffer[bgOffset + y * SCREEN_WIDTH + x];
-                int spriteRelativePrio = bgPriorities[priority].first;
-
-                if(windowed) {
-                    if(window0 && 
-                       ((window0Left <= x && x < window0Right) || 
-                        ((int8_t)window0Left <= (int8_t)x && (int8_t)x < (int8_t)window0Right))) {
-                        windowBgMask = scanlineBgWindowData[y].metaData; 
-                    }   
-                    else if(window1 &&                        
-                           ((window1Left <= x && x < window1Right) || 
-                           ((int8_t)window1Left <= (int8_t)x && (int8_t)x < (int8_t)window1Right))) {
-                        windowBgMask = scanlineBgWindowData[SCREEN_HEIGHT + y].metaData; 
-                    }
-                    else {
-                        windowBgMask = scanlineOutsideWindowData[y]; 
-                    }
-                    if((windowBgMask & (1 << (bgPriorities[priority].second)))) {
-                        if(!isTransparent(bgPixel)) {
-                            pixelBuffer[y * SCREEN_WIDTH + x] = bgPixel & 0xFFFF;
-                        }                        
-                    } 
-                    if(windowBgMask & 0x10) {
-                        // obj enable
-                        for(int spritePrio = spriteRelativePrio; spritePrio >= 0; spritePrio--) {
-                            uint32_t spriteOffset = spritePrio * SCREEN_HEIGHT * SCREEN_WIDTH;
-                            uint32_t spritePixel = spriteBuffer[spriteOffset + y * SCREEN_WIDTH + x];
-                            if(!isTransparent(spritePixel)) {
-                                pixelBuffer[y * SCREEN_WIDTH + x] = spritePixel & 0xFFFF;
-                        
-                            }
-                        }
-                    }
-                    // TODO: sprite window
-
-                } else {
-                    if(!isTransparent(bgPixel)) {
-                        pixelBuffer[y * SCREEN_WIDTH + x] = bgPixel & 0xFFFF;
-                    } 
-                    for(int spritePrio = spriteRelativePrio; spritePrio >= 0; spritePrio--) {
-                        uint32_t spriteOffset = spritePrio * SCREEN_HEIGHT * SCREEN_WIDTH;
-                        uint32_t spritePixel = spriteBuffer[spriteOffset + y * SCREEN_WIDTH + x];
-                        if(!isTransparent(spritePixel)) {
-                            pixelBuffer[y * SCREEN_WIDTH + x] = spritePixel & 0xFFFF;        
-                        }
-                    }
-                }
+        if(spriteLinePriorities[scanline & 1] & (1 << priority)) {
+            layerLines[layerCount] = spriteLines[scanline & 1][priority].data();
+            layerWindowBits[layerCount] = 0x10;
+            layerCount++;
+        }
+    }
 
-            }
+    buildWindowMask(scanline);
+
+    uint32_t* out = &pixelBuffer[scanline * SCREEN_WIDTH];
+    std::fill(out, out + SCREEN_WIDTH, getBackdropColour() | opaque);
+    for(uint32_t i = 0; i < layerCount; i++) {
+        composeLayer(out, layerLines[i], layerWindowBits[i]);
+    }
+}
 
+namespace {
+    // start <= i < end, wrapping around when start > end
+    bool isInWindowRange(uint8_t start, uint8_t end, uint32_t i) {
+        if(start <= end) {
+            return start <= i && i < end;
         }
+        return start <= i || i < end;
     }
-    bgBuffer.fill(transparentColour | lowestPrio);
-    spriteBuffer.fill(transparentColour);
-    for(auto& windowData : scanlineBgWindowData) {
-        windowData.enabled = false;
+}
+
+void PPU::buildWindowMask(uint16_t scanline) {
+    const BgWindowData& window0 = lineWindows[0];
+    const BgWindowData& window1 = lineWindows[1];
+    if(!window0.enabled && !window1.enabled) {
+        // TODO: sprite window
+        windowMask.fill(0x3F);
+        return;
     }
 
-    return pixelBuffer;
+    windowMask.fill(lineOutsideWindowData);
+    // window 1 first, window 0 has the higher priority where they overlap
+    for(const BgWindowData* window : {&window1, &window0}) {
+        if(!window->enabled || !isInWindowRange(window->top, window->bottom, scanline)) {
+            continue;
+        }
+        // a right edge past the screen is clamped, a left edge past the right edge wraps around
+        uint32_t left = std::min<uint32_t>(window->left, SCREEN_WIDTH);
+        uint32_t right = std::min<uint32_t>(window->right, SCREEN_WIDTH);
+        if(window->left <= window->right) {
+            std::fill(windowMask.begin() + left, windowMask.begin() + right, window->metaData);
+        } else {
+            std::fill(windowMask.begin() + left, windowMask.end(), window->metaData);
+            std::fill(windowMask.begin(), windowMask.begin() + right, window->metaData);
+        }
+    }
+}
+
+// draws the opaque pixels of layer that are enabled by windowBit in the window mask over out
+void PPU::composeLayer(uint32_t* out, const uint32_t* layer, uint32_t windowBit) {
+#ifdef __SSE2__
+    // 4 pixels at a time with a compare and select, SCREEN_WIDTH is a multiple of 4
+    const __m128i transparent = _mm_set1_epi32(transparentColour);
+    const __m128i colour = _mm_set1_epi32(colourMask);
+    const __m128i alpha = _mm_set1_epi32(opaque);
+    const __m128i window = _mm_set1_epi32(windowBit);
+    const __m128i zero = _mm_setzero_si128();
+    for(uint32_t x = 0; x < SCREEN_WIDTH; x += 4) {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)&layer[x]);
+        __m128i below = _mm_loadu_si128((const __m128i*)&out[x]);
+        __m128i visible = _mm_and_si128(_mm_cmpeq_epi32(_mm_and_si128(pixels, transparent), zero),
+                                        _mm_cmpeq_epi32(_mm_and_si128(_mm_load_si128((const __m128i*)&windowMask[x]), window), window));
+        pixels = _mm_or_si128(_mm_and_si128(pixels, colour), alpha);
+        _mm_storeu_si128((__m128i*)&out[x], _mm_or_si128(_mm_and_si128(visible, pixels), _mm_andnot_si128(visible, below)));
+    }
+#else
+    for(uint32_t x = 0; x < SCREEN_WIDTH; x++) {
+        if(!(layer[x] & transparentColour) && (windowMask[x] & windowBit)) {
+            out[x] = (layer[x] & colourMask) | opaque;
+        }
+    }
+#endif
 }
 
 
@@ -3,9 +3,16 @@
 #include <array>
 #include <queue>
 #include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "Scheduler.h"
+#include "util/RingBuffer.h"
 
 class Bus; 
-class Scheduler;
+class ARM7TDMI;
+class DMA;
 
 class PPU {
 
@@ -14,7 +21,12 @@ class PPU {
         ~PPU();
 
         void renderScanline(uint16_t scanline);
-        void renderObject();
+        // renders the lines that started up to now, has to be called before anything the renderer reads
+        // (VRAM, OAM, palette RAM, lcd registers) is written
+        void catchUp();
+
+        // clears all the render buffers
+        void reset();
         bool isObjectDirty();
 
         static const uint32_t H_VISIBLE_CYCLES = 960;
@@ -28,40 +40,129 @@ class PPU {
         static const uint32_t SCREEN_WIDTH = 240;
         static const uint32_t SCREEN_HEIGHT = 160;
 
-        std::array<uint16_t, SCREEN_WIDTH * SCREEN_HEIGHT>& renderCurrentScreen();
+        std::array<uint32_t, SCREEN_WIDTH * SCREEN_HEIGHT>& renderCurrentScreen();
 
-        std::array<uint16_t, SCREEN_WIDTH * SCREEN_HEIGHT> pixelBuffer = {};
+        // host RGBA8888 pixels, red in the lowest byte
+        std::array<uint32_t, SCREEN_WIDTH * SCREEN_HEIGHT> pixelBuffer = {};
 
         void connectBus(std::shared_ptr<Bus> bus);
+        void connectCpu(std::shared_ptr<ARM7TDMI> cpu);
+        void connectDma(std::shared_ptr<DMA> dma);
+        void connectScheduler(std::shared_ptr<Scheduler> scheduler);
+
+        // called once per frame when the ppu enters vblank
+        typedef void (*FrameCallback)(void* context);
+        void setFrameCallback(FrameCallback callback, void* context);
 
-        void updateOamState(uint32_t address, uint8_t value);
+        uint16_t getCurrentScanline();
+        // writes the current DISPSTAT status bits and VCOUNT to the bus
+        void updateBusToPrepareForLcdRead();
+        // has to be called when DISPSTAT irq settings or hblank dmas change
+        void updateLineEventScheduling();
 
+        // has to be called on every OAM write, the decoded sprite table is rebuilt before the next line is rendered
         void setObjectsDirty();
+        // has to be called on every VRAM write, the touched tiles are decoded again when they are next drawn
+        void setVramDirty(uint32_t offset, uint32_t length);
+        // has to be called on every palette RAM write, the palette cache is refreshed before the next line is rendered
+        void setPaletteDirty();
+        // has to be called on every write to the lcd registers that affects the picture, offset from 0x4000000
+        void setDisplayRegistersDirty(uint32_t offset, uint32_t length);
+        // false when the last frame came out the same as the one before because nothing it reads was written,
+        // the frontend can keep showing what it has
+        bool isFrameChanged();
+
+        // renders the lines on a second thread from snapshots taken at the start of each line,
+        // renderCurrentScreen then returns the last frame that thread completed
+        void setRenderThreadEnabled(bool enabled);
+        // while set the lines are not rendered at all, only the state the cpu can observe keeps running.
+        // Takes effect with the next frame when changed from the frame callback
+        void setFrameSkipped(bool skipped);
 
     private:
         std::shared_ptr<Bus> bus; 
         std::shared_ptr<Scheduler> scheduler;
+        std::shared_ptr<ARM7TDMI> cpu;
+        std::shared_ptr<DMA> dma;
+
+        FrameCallback frameCallback = nullptr;
+        void* frameCallbackContext = nullptr;
+
+        static const uint16_t VBLANK_START_LINE = 160;
+        static const uint16_t VBLANK_END_LINE = 227;
+        static const uint16_t TOTAL_LINES = 228;
+
+        // the single scheduler event of the ppu steps through the start of hblank and the start of
+        // the next line, skipping transitions that have no observable effect (no irq, dma or rendering)
+        uint16_t lastEventScanline;
+        bool lastEventInHBlank;
+        uint64_t lastEventCycle;
+        uint16_t nextEventScanline;
+        bool nextEventInHBlank;
+        uint64_t nextEventCycle;
+
+        static void onLineEvent(void* context, Scheduler::Event* event);
+        void scheduleNextLineEvent(uint64_t earliestCycle);
+        bool isHBlankObserved();
+        bool isLineStartObserved(uint16_t scanline);
+        void enterHBlank();
+        void enterLine(uint16_t scanline);
+
+        // lines are rendered lazily: the next line start that has not been rendered yet
+        uint16_t catchUpScanline;
+        uint64_t catchUpCycle;
+        // without render the lines are passed over, their output would be the same as in the previous frame
+        void catchUpTo(uint64_t cycle, bool render);
+
+        bool frameSkipped = false;
+
+        // a frame is not rendered again when nothing it reads was written since the previous frame started
+        uint64_t lastDisplayWriteCycle;
+        // the pixel buffer holds the whole previous frame
+        bool frameDrawn;
+        bool frameChanged;
+        void setDisplayWritten();
+
+        // renders the lines that follow scanline, see renderScanline
+        void drawScanline(uint16_t scanline);
 
         uint32_t indexBgPalette4Bpp(uint8_t index);
         uint32_t indexBgPalette8Bpp(uint8_t index);
         uint32_t indexObjPalette4Bpp(uint8_t index);        
         uint32_t indexObjPalette8Bpp(uint8_t index);  
-        uint16_t getBackdropColour();   
+        uint32_t getBackdropColour();   
+
+        // colours in the layer buffers are host RGB in bits 0-23, the top byte (the alpha channel of the output) 
+        // carries the layer flags
+        const uint32_t transparentColour = 0x04000000;
+        const uint32_t colourMask = 0x00FFFFFF;
+        const uint32_t opaque = 0xFF000000;
+
+        // each line is composited into pixelBuffer as soon as it is rendered, so only the layers of
+        // the current line are kept
 
-        const uint32_t transparentColour = 0x00040000;
-        const uint32_t lowestPrio = 0x00030000;
-        bool isTransparent(uint32_t pixelData);
+        // each element: bits 0-23: colour, bit 24-25: drawMode, bit 26: transparent
+        // the sprites are rendered one line ahead of the bgs, so the two lines are kept: [line & 1][priority][x]
+        std::array<std::array<std::array<uint32_t, SCREEN_WIDTH>, 4>, 2> spriteLines;
+        // one bit per priority that has sprites on the line, [line & 1]
+        std::array<uint8_t, 2> spriteLinePriorities;
 
-        // each element of array: bits 0-15: colour, bit 16-17: drawMode, bit 18: transparent,
-        // to find sprite pixel of priority i at location (x,y) -> [i * SCREEN_WIDTH * SCREEN_HEIGHT + y * SCREEN_WIDTH + x]
-        std::array<uint32_t, SCREEN_WIDTH * SCREEN_HEIGHT * 4> spriteBuffer = {};
+        // each element: bits 0-23: colour, bit 26: transparent
+        // [bg][x]
+        std::array<std::array<uint32_t, SCREEN_WIDTH>, 4> bgLines;
 
-        // each element of array: bits 0-15: colour, bits 16-17: priority, bit 18: transparent
-        // to find pixel of bg#i at location (x,y) -> [i * SCREEN_WIDTH * SCREEN_HEIGHT + y * SCREEN_WIDTH + x]
-        std::array<uint32_t, SCREEN_WIDTH * SCREEN_HEIGHT * 4> bgBuffer = {};
+        // palette RAM (256 bg + 256 obj colours) mirrored as BGR555 and as host RGBA8888
+        std::array<uint16_t, 512> paletteBgr555;
+        std::array<uint32_t, 512> paletteRgba;
+        // the 256 bg colours with colour 0 transparent, so an 8bpp pixel is a single table lookup
+        std::array<uint32_t, 256> bgPaletteLookup;
+        bool paletteDirty;
+        void updatePaletteCache();
+        static uint32_t convertBgr555ToRgba(uint16_t colour);
+        // converts pixels BGR555 pixels as stored in VRAM (little endian) to RGBA8888
+        static void convertBgr555LineToRgba(uint32_t* out, const uint8_t* colours, uint32_t pixels);
 
-        // backdrop colour for each scanline
-        std::array<uint16_t, SCREEN_HEIGHT> scanlineBackDropColours;
+        void renderBitmapLine(uint16_t scanline, uint8_t bgMode);
 
 
         bool dirty;
@@ -69,6 +170,27 @@ class PPU {
         void renderSprites(uint16_t scanline);
         void renderBg(uint16_t scanline);
         void renderBgX(uint16_t scanline, uint8_t x);
+        void renderAffineBgX(uint8_t x);
+
+        // internal reference points of the rotation/scaling bgs 2 and 3 ([x - 2]), 20.8 fixed point with 28 bits.
+        // Loaded from BGxX/BGxY at the start of the frame and when those are written, moved by PB/PD after each line
+        std::array<int32_t, 2> affineX;
+        std::array<int32_t, 2> affineY;
+        // bit 0: BG2X, bit 1: BG2Y, bit 2: BG3X, bit 3: BG3Y, loaded before the next line is rendered
+        uint8_t affineReloadPending;
+        void updateAffineReferences(uint16_t scanline);
+        void stepAffineReferences();
+
+        // DISPCNT bits 8-11 (BG0-BG3 enable) and the BGxCNT priorities (2 bits per bg) of the current line
+        uint8_t lineBgEnabled;
+        uint8_t lineBgPriorities;
+        void latchLineLayers(uint8_t bgEnableMask);
+
+        // per pixel window enable bits (bits 0-5 of WININ / WINOUT) of the line being composited
+        alignas(16) std::array<uint32_t, SCREEN_WIDTH> windowMask;
+        void buildWindowMask(uint16_t scanline);
+        void composeLine(uint16_t scanline);
+        void composeLayer(uint32_t* out, const uint32_t* layer, uint32_t windowBit);
 
         struct Dimension {
             uint8_t width;
@@ -95,15 +217,15 @@ class PPU {
             int32_t y;
         };
 
-        // to find window y data at scanline x: [x * SCREEN_HEIGHT + y]
-        std::array<BgWindowData, SCREEN_HEIGHT * 2> scanlineBgWindowData;
+        // window 0 and 1 of the current line
+        std::array<BgWindowData, 2> lineWindows;
         /*
             Bit   Expl.
             0-3   Outside BG0-BG3 Enable Bits      (0=No Display, 1=Display)
             4     Outside OBJ Enable Bit           (0=No Display, 1=Display)
             5     Outside Color Special Effect     (0=Disable, 1=Enable)
         */
-        std::array<uint8_t, SCREEN_HEIGHT> scanlineOutsideWindowData;
+        uint8_t lineOutsideWindowData;
 
         /*
             Bit   Expl.
@@ -111,7 +233,7 @@ class PPU {
             12    OBJ Window OBJ Enable Bit        (0=No Display, 1=Display)
             13    OBJ Window Color Special Effect  (0=Disable, 1=Enable)
         */
-        std::array<uint8_t, SCREEN_HEIGHT> scanlineObjectWindowData;
+        uint8_t lineObjectWindowData;
 
         // in TILES, not pixels
         // [shape][size]
@@ -128,6 +250,111 @@ class PPU {
             {64, 64}
         };
 
+        // OAM attributes decoded once per change instead of on every scanline
+        struct Sprite {
+            bool affine;
+            bool hFlip;
+            bool vFlip;
+            bool colorMode;
+            // to be included in spriteLines pixel bits 24-25
+            uint32_t drawMode;
+            uint32_t base;
+            uint8_t paletteBank;
+            uint8_t priority;
+            uint8_t affineIndex;
+            Dimension dim;
+            int32_t width;
+            int32_t height;
+            int32_t boundingWidth;
+            int32_t boundingHeight;
+            int32_t screenXOffset;
+            int32_t screenYOffset;
+        };
+
+        struct AffineParameters {
+            int16_t pa;
+            int16_t pb;
+            int16_t pc;
+            int16_t pd;
+        };
+
+        std::array<Sprite, 128> sprites;
+        std::array<AffineParameters, 32> affineParameters;
+        // indices into sprites covering each scanline, in drawing order (OAM entry 127 first)
+        std::array<std::array<uint8_t, 128>, SCREEN_HEIGHT> scanlineSprites;
+        std::array<uint8_t, SCREEN_HEIGHT> scanlineSpriteCounts;
+
+        void buildSpriteTable();
+
+        // VRAM in units of 32 byte (one 4bpp tile)
+        static const uint32_t VRAM_TILES = 0x18000 / 32;
+        // 4bpp tiles expanded to one palette index byte per pixel, 8 bytes per row
+        std::array<uint8_t, VRAM_TILES * 64> decodedTiles;
+        std::array<bool, VRAM_TILES> tileDirty;
+
+        // returns the 64 palette indices of the 4bpp tile at tileAddress (vram offset)
+        const uint8_t* getDecodedTile(uint32_t tileAddress);
+        void decodeTile(uint32_t tile);
+
+        // the memory that is rendered from: the bus memory itself, or the render thread's copy of it
+        uint8_t* renderIo;
+        uint8_t* renderVram;
+        uint8_t* renderPalette;
+        uint8_t* renderOam;
+
+        // the lcd registers (0x04000000 - 0x04000057) are all the io the renderer reads
+        static const uint32_t RENDER_IO_SIZE = 0x58;
+        static const uint32_t RENDER_COMMAND_BUFFER_SIZE = 1 << 20;
+        static const uint16_t STOP_RENDER_THREAD = 0xFFFF;
+
+        // followed by the io registers, then palette RAM and OAM if included, then per changed vram tile
+        // its index (uint16_t) and its 32 bytes
+        struct RenderCommand {
+            uint16_t scanline;
+            bool paletteIncluded;
+            bool oamIncluded;
+            // affineReloadPending bits
+            uint8_t affineReload;
+            uint32_t vramTiles;
+        };
+
+        struct RenderMemory {
+            std::array<uint8_t, 1028> iORegisters;
+            std::array<uint8_t, 1028> paletteRam;
+            std::array<uint8_t, 98688> vRam;
+            std::array<uint8_t, 1028> objAttributes;
+        };
+
+        bool renderThreadEnabled = false;
+        std::thread renderThread;
+        std::unique_ptr<RingBuffer<uint8_t, RENDER_COMMAND_BUFFER_SIZE>> renderCommands;
+        std::unique_ptr<RenderMemory> renderMemory;
+        // the render thread only sleeps for short periods, a missed notify just delays it a little
+        std::mutex renderCommandMutex;
+        std::condition_variable renderCommandsAvailable;
+        std::atomic<bool> renderThreadWaiting{false};
+
+        // memory written since the last submitted line, only touched by the emulation thread
+        bool paletteChanged;
+        bool objectsChanged;
+        uint8_t affineReferencesChanged;
+        std::vector<uint16_t> changedVramTiles;
+        std::array<bool, VRAM_TILES> vramTileChanged;
+        std::vector<uint8_t> commandStaging;
+
+        std::mutex frameMutex;
+        // the last frame the render thread completed and the copy of it handed out by renderCurrentScreen
+        std::array<uint32_t, SCREEN_WIDTH * SCREEN_HEIGHT> completedFrame = {};
+        std::array<uint32_t, SCREEN_WIDTH * SCREEN_HEIGHT> presentedFrame = {};
+        uint64_t completedFrames = 0;
+        uint64_t presentedFrames = 0;
+
+        void submitScanline(uint16_t scanline);
+        void runRenderThread();
+        void stopRenderThread();
+        void pushRenderCommand();
+        void useRenderMemory(bool own);
+
         Coords convertScreenCoordsToSpriteCoords(int32_t x, int32_t y, int16_t pa, int16_t pb, int16_t pc, int16_t pd, int32_t xRotCentre, int32_t yRotCentre);
 
 
@@ -1,140 +1,140 @@
 #include "Scheduler.h"
 #include "GameBoyAdvanceImpl.h"
 #include <iostream>
+#include <algorithm>
 #include "util/macros.h"
 
 #include "assert.h"
 
 
-void Scheduler::addEvent(EventType eventType, uint64_t cyclesInFuture, EventCondition eventCondition, bool ignoreCondition) {
-    // printEventList();
+Scheduler::Scheduler() {
+    keys.fill(EMPTY_SLOT);
+}
+
+void Scheduler::addEvent(EventType eventType, uint64_t cyclesInFuture, EventCondition eventCondition,
+                         EventCallback callback, void* context) {
     uint64_t startAt = GameBoyAdvanceImpl::cyclesSinceStart + cyclesInFuture;
+    if(startAt - baseCycle >= REBASE_THRESHOLD) {
+        rebase(startAt);
+    }
 
-    EventNode* node = &events[eventType];
-    node->event.active = true;
-    node->event.startCycle = startAt;
-    node->next = nullptr;
-    node->event.eventCondition = eventCondition;
-
-    if(startNode == nullptr && eventCondition == NULL_CONDITION) {
-        startNode = node;
-    } else {
-        removeNode(node);
-        EventNode* curr = startNode;
-        EventNode* prev = nullptr;
-        while(curr != nullptr) {
-            if(eventCondition == NULL_CONDITION || ignoreCondition) {
-                if((curr->event.startCycle > startAt) || 
-                (curr->event.startCycle == startAt && eventType < curr->event.eventType)) {
-                    break;
-                } 
-            } else {
-                bool found = false;
-                switch(eventCondition) {
-                    case EventCondition::HBLANK_START:
-                    case EventCondition::DMA3_VIDEO_MODE: {
-                        if(curr->event.eventType == EventType::HBLANK ) {
-                            found = true;
-                            node->event.startCycle = curr->event.startCycle;
-                        }
-                        break;
-                    }
-                    case EventCondition::VBLANK_START: {
-                        if(curr->event.eventType == EventType::VBLANK) {
-                            found = true;
-                            node->event.startCycle = curr->event.startCycle;
-                        }                                
-                        break;
-                    }
-                    default: {
-                        assert(false);
-                        break;
-                    }
-                }
-                if(found) {
-                    // putting the event condition event *after* the event that activates the condition
-                    prev = curr;
-                    curr = curr->next;
-                    while(curr != nullptr && 
-                          curr->event.eventType < eventType && 
-                          curr->event.eventCondition == eventCondition) {
-                        // make sure DMA priority is maintained
-                        curr = curr->next;
-                    }
-                    break;
-                }
-            }
-            prev = curr;
-            curr = curr->next;
-        }
+    Event* event = &events[eventType];
+    event->active = true;
+    event->startCycle = startAt;
+    event->eventCondition = eventCondition;
+    event->callback = callback;
+    event->context = context;
 
-        node->next = curr;
-        if(prev != nullptr) {
-            prev->next = node;
-        } else {
-            startNode = node;
-        }
+    uint64_t oldKey = keys[eventType];
+    keys[eventType] = ((startAt - baseCycle) << 4) | eventType;
+    if(oldKey == nextKey) {
+        findNextKey();
+    } else if(keys[eventType] < nextKey) {
+        nextKey = keys[eventType];
     }
 }
 
-void Scheduler::removeNode(EventNode* eventNode) {
-    if(startNode == nullptr) {
-        startNode = nullptr;
-    } else if(startNode == eventNode){
-        startNode = startNode->next;
-    } else {
-        EventNode* curr = startNode;
-        while(curr->next != nullptr) {
-            if(curr->next == eventNode) {
-                curr->next = curr->next->next;
-                break;
-            } 
-            curr = curr->next;
+void Scheduler::rebase(uint64_t startCycle) {
+    uint64_t newBase = startCycle;
+    for(uint8_t slot = 0; slot < events.size(); slot++) {
+        if(keys[slot] != EMPTY_SLOT && events[slot].startCycle < newBase) {
+            newBase = events[slot].startCycle;
         }
     }
-    eventNode->next = nullptr;
+    for(uint8_t slot = 0; slot < events.size(); slot++) {
+        if(keys[slot] != EMPTY_SLOT) {
+            assert(events[slot].startCycle - newBase < REBASE_THRESHOLD);
+            keys[slot] = ((events[slot].startCycle - newBase) << 4) | slot;
+        }
+    }
+    baseCycle = newBase;
+    findNextKey();
+}
+
+void Scheduler::findNextKey() {
+    uint64_t minKey = EMPTY_SLOT;
+    for(uint64_t key : keys) {
+        minKey = key < minKey ? key : minKey;
+    }
+    nextKey = minKey;
+}
+
+void Scheduler::removeSlot(uint8_t slot) {
+    uint64_t oldKey = keys[slot];
+    keys[slot] = EMPTY_SLOT;
+    if(oldKey == nextKey && oldKey != EMPTY_SLOT) {
+        findNextKey();
+    }
 }
 
 Scheduler::Event* Scheduler::getNextEvent(uint64_t currentCycle) {
     Event* toReturn = nullptr;
 
-    if(startNode != nullptr && startNode->event.startCycle <= currentCycle) {
-        toReturn = &startNode->event;
-        EventNode* oldStart = startNode;
-        startNode = startNode->next;
-        oldStart->next = nullptr;
-    }    
+    if(nextKey != EMPTY_SLOT) {
+        uint8_t slot = nextKey & 0xF;
+        if(events[slot].startCycle <= currentCycle) {
+            toReturn = &events[slot];
+            removeSlot(slot);
+        }
+    }
 
     return toReturn;
 }
 
+void Scheduler::dispatchEvents() {
+    // callbacks (e.g. DMA transfers) can advance cyclesSinceStart, so it is re-read every iteration
+    Event* nextEvent = getNextEvent(GameBoyAdvanceImpl::cyclesSinceStart);
+    while(nextEvent != nullptr) {
+        if(nextEvent->callback != nullptr) {
+            nextEvent->callback(nextEvent->context, nextEvent);
+        } else {
+            DEBUGWARN("event " << nextEvent->eventType << " has no callback\n");
+        }
+        nextEvent = getNextEvent(GameBoyAdvanceImpl::cyclesSinceStart);
+    }
+}
+
 Scheduler::Event* Scheduler::peekNextEvent() {
     Event* toReturn = nullptr;
-    if(startNode != nullptr) {
-        toReturn = &startNode->event;
+    if(nextKey != EMPTY_SLOT) {
+        toReturn = &events[nextKey & 0xF];
     }
     return toReturn;
 }
 
 void Scheduler::removeEvent(EventType eventType) {
-    EventNode* node = &events[eventType];
-    removeNode(node);
+    removeSlot(eventType);
+}
 
+void Scheduler::reset() {
+    for(Event& event : events) {
+        event.active = false;
+        event.startCycle = 0;
+        event.eventCondition = NULL_CONDITION;
+        event.callback = nullptr;
+        event.context = nullptr;
+    }
+    keys.fill(EMPTY_SLOT);
+    baseCycle = 0;
+    nextKey = EMPTY_SLOT;
 }
 
 void Scheduler::printEventList() {
+    std::array<uint64_t, 16> sortedKeys = keys;
+    std::sort(sortedKeys.begin(), sortedKeys.end());
+
     std::cout << "[\n";
-    EventNode* curr = startNode;
-    int size = 0;
-    while(curr != nullptr) {
-        size++;
-        std::cout << "{eventType: " << (curr->event.eventType) 
-                  << " startCycle: " << curr->event.startCycle 
-                  << " active: " << curr->event.active 
-                  <<  " eventCond: " << curr->event.eventCondition 
+    for(uint64_t key : sortedKeys) {
+        if(key == EMPTY_SLOT) {
+            break;
+        }
+        Event* event = &events[key & 0xF];
+        std::cout << "{eventType: " << (event->eventType) 
+                  << " startCycle: " << event->startCycle 
+                  << " active: " << event->active 
+                  <<  " eventCond: " << event->eventCondition 
                   << "},\n";
-        curr = curr->next;
     }
     std::cout << "]\n";
 
-}  
\ No newline at end of file
+}
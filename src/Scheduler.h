@@ -2,64 +2,70 @@
 #pragma once
 
 #include <cstdint>
-#include <list>
 #include <array>
 
 class Scheduler {
 
     public: 
-        //Scheduler();
+        Scheduler();
 
         enum EventType {
-            HBLANK = 0,
-            VBLANK = 1,
+            // drives the PPU's line / hblank / vblank state machine
+            PPU_LINE = 0,
             
-            TIMER0 = 2,
-            TIMER1 = 3,
-            TIMER2 = 4,
-            TIMER3 = 5,
-
-            VBLANK_END = 6,
-            HBLANK_END = 7,
-
-            NULL_EVENT = 8,
-
-            DMA0 = 9,
-            DMA1 = 10,
-            DMA2 = 11,
-            DMA3 = 12,
+            TIMER0 = 1,
+            TIMER1 = 2,
+            TIMER2 = 3,
+            TIMER3 = 4,
+
+            DMA0 = 5,
+            DMA1 = 6,
+            DMA2 = 7,
+            DMA3 = 8,
         };
 
+        // what started a DMA event
         enum EventCondition {
             DMA3_VIDEO_MODE = 0,
             VBLANK_START = 1,
             HBLANK_START = 2,
-            NULL_CONDITION = 3
+            NULL_CONDITION = 3,
+            SOUND_FIFO = 4
         };
 
         static constexpr inline uint8_t convertDmaTypeToDmaVal(EventType dma) {
-            return dma - 9;
+            return dma - 5;
         };
 
         static constexpr inline uint8_t convertDmaValToDmaEvent(uint8_t x) {
-            return x + 9;
+            return x + 5;
         };
 
 
+        struct Event;
+
+        // called by dispatchEvents() when an event is due. context is the pointer given to addEvent()
+        typedef void (*EventCallback)(void* context, Event* event);
+
         struct Event {
             EventType eventType;
             uint64_t startCycle;
             bool active = true;
             EventCondition eventCondition;
+            EventCallback callback = nullptr;
+            void* context = nullptr;
         };
 
-        void addEvent(EventType eventType, uint64_t cyclesInFuture, EventCondition EventCondition, bool ignoreCondition);
+        void addEvent(EventType eventType, uint64_t cyclesInFuture, EventCondition EventCondition,
+                      EventCallback callback = nullptr, void* context = nullptr);
         void removeEvent(EventType eventType);
 
+        // runs the callbacks of all events that are due, in order
+        void dispatchEvents();
+
         /*
             get next event with a cycle start less than currentCycle. Removes the event from the queue
-
-            If eventCondition != NONE, returned event is guaranteed to be one of [DMA0 - DMA3]
+            Events due on the same cycle are returned in EventType order
         */
         Event* getNextEvent(uint64_t currentCycle);
 
@@ -67,31 +73,36 @@ class Scheduler {
 
         void printEventList();
 
-    private: 
-        struct EventNode {
-            Event event;
-            EventNode* next = nullptr;
-            EventNode* prev = nullptr;
-        };
+        // removes all events from the queue
+        void reset();
 
-         std::array<EventNode, 13> events = {{
-                                    {{HBLANK, 0, false, NULL_CONDITION}, nullptr, nullptr}, 
-                                    {{VBLANK, 0, false, NULL_CONDITION}, nullptr, nullptr},
-                                    {{TIMER0, 0, false, NULL_CONDITION}, nullptr, nullptr},
-                                    {{TIMER1, 0, false, NULL_CONDITION}, nullptr, nullptr},
-                                    {{TIMER2, 0, false, NULL_CONDITION}, nullptr, nullptr},
-                                    {{TIMER3, 0, false, NULL_CONDITION}, nullptr, nullptr},
-                                    {{VBLANK_END, 0, false, NULL_CONDITION}, nullptr, nullptr},
-                                    {{HBLANK_END, 0, false, NULL_CONDITION}, nullptr, nullptr},
-                                    {{NULL_EVENT, 0, false, NULL_CONDITION}, nullptr, nullptr},
-                                    {{DMA0, 0, false, NULL_CONDITION}, nullptr, nullptr},
-                                    {{DMA1, 0, false, NULL_CONDITION}, nullptr, nullptr},
-                                    {{DMA2, 0, false, NULL_CONDITION}, nullptr, nullptr},
-                                    {{DMA3, 0, false, NULL_CONDITION}, nullptr, nullptr}
+    private: 
+        /*
+            Each event type owns one slot. Queued slots hold a packed key (deadline << 4) | slot,
+            where the deadline is relative to baseCycle. The smallest key is the next event to run.
+        */
+        static constexpr uint64_t EMPTY_SLOT = UINT64_MAX;
+        static constexpr uint64_t REBASE_THRESHOLD = 0x80000000;
+
+        std::array<Event, 9> events = {{
+                                    {PPU_LINE, 0, false, NULL_CONDITION},
+                                    {TIMER0, 0, false, NULL_CONDITION},
+                                    {TIMER1, 0, false, NULL_CONDITION},
+                                    {TIMER2, 0, false, NULL_CONDITION},
+                                    {TIMER3, 0, false, NULL_CONDITION},
+                                    {DMA0, 0, false, NULL_CONDITION},
+                                    {DMA1, 0, false, NULL_CONDITION},
+                                    {DMA2, 0, false, NULL_CONDITION},
+                                    {DMA3, 0, false, NULL_CONDITION}
                                 }};
 
-        EventNode* startNode = nullptr;
-        
-        void removeNode(EventNode* eventNode);
+        // padded to 16 so the min scan has a fixed trip count
+        std::array<uint64_t, 16> keys;
+        uint64_t baseCycle = 0;
+        uint64_t nextKey = EMPTY_SLOT;
+
+        void removeSlot(uint8_t slot);
+        void rebase(uint64_t startCycle);
+        void findNextKey();
         
 };
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include "arm7tdmi/ARM7TDMI.h"
 #include "Scheduler.h"
 #include "GameBoyAdvanceImpl.h"
+#include "APU.h"
 
 
 /*
@@ -12,25 +13,25 @@ uint8_t Timer::updateBusToPrepareForTimerRead(uint32_t address, uint8_t width) {
     // manually preparing the memory so that what's read will be up to date
     switch(address) {
         case 0x4000100: {
-            calculateTimerXCounter(0, GameBoyAdvanceImpl::cyclesSinceStart);
+            updateTimerXCounter(0);
             bus->iORegisters[Bus::IORegister::TM0CNT_L] = timerCounter[0]; 
             bus->iORegisters[Bus::IORegister::TM0CNT_L + 1] = (timerCounter[0]) >> 8; 
             break;
         }
         case 0x4000104: {
-            calculateTimerXCounter(1, GameBoyAdvanceImpl::cyclesSinceStart);
+            updateTimerXCounter(1);
             bus->iORegisters[Bus::IORegister::TM1CNT_L] = timerCounter[1]; 
             bus->iORegisters[Bus::IORegister::TM1CNT_L + 1] = (timerCounter[1]) >> 8; 
             break;
         }
         case 0x4000108: {
-            calculateTimerXCounter(2, GameBoyAdvanceImpl::cyclesSinceStart);
+            updateTimerXCounter(2);
             bus->iORegisters[Bus::IORegister::TM2CNT_L] = timerCounter[2]; 
             bus->iORegisters[Bus::IORegister::TM2CNT_L + 1] = (timerCounter[2]) >> 8; 
             break;
         }
         case 0x400010C: {
-            calculateTimerXCounter(3, GameBoyAdvanceImpl::cyclesSinceStart);
+            updateTimerXCounter(3);
             bus->iORegisters[Bus::IORegister::TM3CNT_L] = timerCounter[3]; 
             bus->iORegisters[Bus::IORegister::TM3CNT_L + 1] = (timerCounter[3]) >> 8; 
             break;
@@ -132,19 +133,19 @@ void Timer::setTimerXControlHi(uint8_t val, uint8_t x) {
 
 inline
 void Timer::setTimerXControlLo(uint8_t val, uint8_t x) {
-    Scheduler::EventType timerEvent;
-    switch(x) {
-        case 0: { timerEvent = Scheduler::EventType::TIMER0; break; }
-        case 1: { timerEvent = Scheduler::EventType::TIMER1; break; }
-        case 2: { timerEvent = Scheduler::EventType::TIMER2; break; }
-        case 3: { timerEvent = Scheduler::EventType::TIMER3; break; }
-        default: { break; }
+    uint8_t prescalerSelection = val & 0x3;
+
+    if(!timerStart[x] && (val & 0x80)) {
+        // reload value is copied into the counter when the timer start bit becomes changed from 0 to 1.
+        timerCounter[x] = timerReload[x];
     }
 
-    // remove old event
-    scheduler->removeEvent(timerEvent);
+    // update counters with the old settings, this write can change whether the previous timer is observed
+    updateTimerXCounter(x);
+    if(x != 0) {
+        updateTimerXCounter(x - 1);
+    }
 
-    uint8_t prescalerSelection = val & 0x3;
     switch(prescalerSelection) {
         case 0: { timerPrescaler[x] = 1; break; }
         case 1: { timerPrescaler[x] = 64; break; }
@@ -153,34 +154,65 @@ void Timer::setTimerXControlLo(uint8_t val, uint8_t x) {
         default: { break; }
     }
 
-    if(!timerStart[x] && (val & 0x80)) {
-        // reload value is copied into the counter when the timer start bit becomes changed from 0 to 1.
-        timerCounter[x] = timerReload[x];
+    timerCountUp[x] = val & 0x4;
+    timerIrqEnable[x] = val & 0x40;
+    timerStart[x] = val & 0x80;
+
+    scheduleTimerX(x);
+    if(x != 0) {
+        scheduleTimerX(x - 1);
     }
+}
 
-    uint64_t cyclesPassed = GameBoyAdvanceImpl::cyclesSinceStart;
+uint32_t Timer::getTimerXOverflowBatch(uint8_t x) {
+    // number of overflows that may pass before one has to be handled, 
+    // 0 if nobody observes them. The counter is then wrapped on read
+    if(timerIrqEnable[x]) {
+        return 1;
+    }
+    // count-up timers only advance through the overflow event of the previous timer
+    if(x < 3 && timerStart[x + 1] && timerCountUp[x + 1]) {
+        return 1;
+    }
+    // the sound fifos only need to see the overflows when they run low
+    return apu != nullptr ? apu->getTimerXOverflowBatch(x) : 0;
+}
 
-    // update counter
-    calculateTimerXCounter(x, cyclesPassed);
+void Timer::scheduleTimerX(uint8_t x) {
+    Scheduler::EventType timerEvent;
+    switch(x) {
+        case 0: { timerEvent = Scheduler::EventType::TIMER0; break; }
+        case 1: { timerEvent = Scheduler::EventType::TIMER1; break; }
+        case 2: { timerEvent = Scheduler::EventType::TIMER2; break; }
+        case 3: { timerEvent = Scheduler::EventType::TIMER3; break; }
+        default: { break; }
+    }
 
-    timerCountUp[x] = val & 0x4;
-    timerIrqEnable[x] = val & 0x40;
-    timerStart[x] = val & 0x80;
+    // remove old event
+    scheduler->removeEvent(timerEvent);
+    timerEventScheduled[x] = false;
 
-    if((val & 0x80) && !(val & 0x4)) {
+    if(!timerStart[x] || timerCountUp[x]) {
         // only schedule if the timer is not count-up (since count up timers will automatically overflow)
-        // timer enabled, so schedule new event
-        if(timerCounter[x] > 0xFFFF) { // if overflow
-            DEBUGWARN("timer overflowed outside of scheduled event!\n");
-            // schedule timer to run immediately
-            scheduler->addEvent(timerEvent, 0, Scheduler::EventCondition::NULL_CONDITION, false);
-        } else {
-            // add event at time when timer will go off
-            scheduler->addEvent(timerEvent, 
-                                (0x10000 - timerCounter[x]) * timerPrescaler[x], 
-                                Scheduler::EventCondition::NULL_CONDITION,
-                                false);
-        }
+        return;
+    }
+    uint32_t batch = getTimerXOverflowBatch(x);
+    if(batch == 0) {
+        return;
+    }
+    timerEventScheduled[x] = true;
+
+    if(timerCounter[x] > 0xFFFF) { // if overflow
+        DEBUGWARN("timer overflowed outside of scheduled event!\n");
+        // schedule timer to run immediately
+        scheduler->addEvent(timerEvent, 0, Scheduler::EventCondition::NULL_CONDITION, &Timer::onTimerEvent, this);
+    } else {
+        // add event at time when timer will go off
+        scheduler->addEvent(timerEvent, 
+                            ((0x10000 - timerCounter[x]) + (uint64_t)(batch - 1) * (0x10000 - timerReload[x])) * timerPrescaler[x], 
+                            Scheduler::EventCondition::NULL_CONDITION,
+                            &Timer::onTimerEvent,
+                            this);
     }
 }
 
@@ -194,6 +226,20 @@ void Timer::setTimerXReloadLo(uint8_t val, uint8_t x) {
     timerReload[x] = (timerReload[x] & 0xFF00) | (uint16_t)val; 
 }
 
+void Timer::reset() {
+    for(int x = 0; x < 4; x++) {
+        timerPrescaler[x] = 1;
+        timerStart[x] = false;
+        timerExcessCycles[x] = 0;
+        timerCycleOfLastUpdate[x] = 0;
+        timerCounter[x] = 0;
+        timerReload[x] = 0;
+        timerCountUp[x] = false;
+        timerIrqEnable[x] = false;
+        timerEventScheduled[x] = false;
+    }
+}
+
 void Timer::connectBus(std::shared_ptr<Bus> bus) {
     this->bus = bus;
 }
@@ -207,6 +253,10 @@ void Timer::connectScheduler(std::shared_ptr<Scheduler> scheduler) {
 }
 
 
+void Timer::onTimerEvent(void* context, Scheduler::Event* event) {
+    static_cast<Timer*>(context)->timerXOverflowEvent(event->eventType - Scheduler::EventType::TIMER0);
+}
+
 void Timer::timerXOverflowEvent(uint8_t x) {
     calculateTimerXCounter(x, GameBoyAdvanceImpl::cyclesSinceStart);
     if(timerCounter[x] <= 0xFFFF) {
@@ -215,37 +265,70 @@ void Timer::timerXOverflowEvent(uint8_t x) {
         return;
     }
 
+    // more than one overflow has passed when the event was batched for the sound fifos
+    uint32_t period = 0x10000 - timerReload[x];
+    uint32_t overflows = 1 + (timerCounter[x] - 0x10000) / period;
+    timerCounter[x] = timerReload[x] + (timerCounter[x] - 0x10000) % period;
+
     if(timerIrqEnable[x]) {
         queueTimerInterrupt(x);
     }
 
-    timerCounter[x] = timerReload[x];
-    uint8_t cascadeX = x + 1;
-    bool overflow = true;
-    while(overflow && cascadeX <= 3 && timerCountUp[cascadeX] && timerStart[cascadeX]) {
-        timerCounter[cascadeX] += 1;
-        if(timerCounter[cascadeX] > 0xFFFF) {
-            if(timerIrqEnable[cascadeX]) {
-                queueTimerInterrupt(cascadeX);
+    if(apu != nullptr) {
+        uint64_t lastOverflowCycle = GameBoyAdvanceImpl::cyclesSinceStart - 
+                                     ((uint64_t)(timerCounter[x] - timerReload[x]) * timerPrescaler[x] + timerExcessCycles[x]);
+        apu->timerXOverflow(x, overflows, lastOverflowCycle, (uint64_t)period * timerPrescaler[x]);
+    }
+
+    for(uint32_t i = 0; i < overflows; i++) {
+        uint8_t cascadeX = x + 1;
+        bool overflow = true;
+        while(overflow && cascadeX <= 3 && timerCountUp[cascadeX] && timerStart[cascadeX]) {
+            timerCounter[cascadeX] += 1;
+            if(timerCounter[cascadeX] > 0xFFFF) {
+                if(timerIrqEnable[cascadeX]) {
+                    queueTimerInterrupt(cascadeX);
+                }
+                timerCounter[cascadeX] = timerReload[cascadeX];
+                if(apu != nullptr) {
+                    apu->timerXOverflow(cascadeX, 1, GameBoyAdvanceImpl::cyclesSinceStart, 0);
+                }
+            } else {
+                overflow = false;
             }
-            timerCounter[cascadeX] = timerReload[cascadeX];
-        } else {
-            overflow = false;
+            cascadeX++;
         }
-        cascadeX++;
     }
-    Scheduler::EventType timerEvent;
-    switch(x) {
-        case 0: { timerEvent = Scheduler::EventType::TIMER0; break; }
-        case 1: { timerEvent = Scheduler::EventType::TIMER1; break; }
-        case 2: { timerEvent = Scheduler::EventType::TIMER2; break; }
-        case 3: { timerEvent = Scheduler::EventType::TIMER3; break; }
-        default: { break; }
+    scheduleTimerX(x);
+}
+
+void Timer::updateTimerXCounter(uint8_t x) {
+    calculateTimerXCounter(x, GameBoyAdvanceImpl::cyclesSinceStart);
+    if(timerEventScheduled[x] && timerCounter[x] > 0xFFFF) {
+        // overflows of a batched event that have already passed
+        timerXOverflowEvent(x);
     }
-    scheduler->addEvent(timerEvent,
-                       (0x10000 - timerCounter[x]) * timerPrescaler[x], 
-                        Scheduler::EventCondition::NULL_CONDITION, 
-                        false);
+}
+
+void Timer::flushOverflows() {
+    for(uint8_t x = 0; x < 4; x++) {
+        if(timerEventScheduled[x]) {
+            updateTimerXCounter(x);
+        }
+    }
+}
+
+void Timer::updateTimerScheduling() {
+    for(uint8_t x = 0; x < 4; x++) {
+        if(timerStart[x] && !timerCountUp[x]) {
+            updateTimerXCounter(x);
+            scheduleTimerX(x);
+        }
+    }
+}
+
+void Timer::connectApu(std::shared_ptr<APU> apu) {
+    this->apu = apu;
 }
 
 inline
@@ -278,7 +361,7 @@ void Timer::calculateTimerXCounter(uint8_t x, uint64_t cyclesPassed) {
     // update counter
     if(!timerCountUp[x]) {
         if(timerStart[x]) {
-            uint32_t increments = ((cyclesPassed - timerCycleOfLastUpdate[x]) + timerExcessCycles[x]) / timerPrescaler[x];
+            uint64_t increments = ((cyclesPassed - timerCycleOfLastUpdate[x]) + timerExcessCycles[x]) / timerPrescaler[x];
 
             if(increments != 0) {
                 timerExcessCycles[x] = ((cyclesPassed - timerCycleOfLastUpdate[x]) + timerExcessCycles[x]) % (timerPrescaler[x]);
@@ -286,7 +369,13 @@ void Timer::calculateTimerXCounter(uint8_t x, uint64_t cyclesPassed) {
                 timerExcessCycles[x] += (cyclesPassed - timerCycleOfLastUpdate[x]);
             }
             
-            timerCounter[x] += increments; 
+            uint64_t counter = timerCounter[x] + increments;
+            if(counter > 0xFFFF && !timerEventScheduled[x]) {
+                // no overflow event was scheduled, wrap the counter around as many reloads as have passed
+                uint32_t period = 0x10000 - timerReload[x];
+                counter = timerReload[x] + (counter - 0x10000) % period;
+            }
+            timerCounter[x] = counter;
         }
         timerCycleOfLastUpdate[x] = cyclesPassed;
     }
@@ -1,10 +1,10 @@
 #include <cstdint>
 #include <memory>
+#include "Scheduler.h"
 
 class Bus;
 class ARM7TDMI;
-class Scheduler;
-
+class APU;
 
 class Timer {
 
@@ -15,10 +15,20 @@ class Timer {
         void connectBus(std::shared_ptr<Bus> bus);
         void connectCpu(std::shared_ptr<ARM7TDMI> cpu);
         void connectScheduler(std::shared_ptr<Scheduler> scheduler);
+        void connectApu(std::shared_ptr<APU> apu);
         void timerXOverflowEvent(uint8_t x);
+        static void onTimerEvent(void* context, Scheduler::Event* event);
 
         void updateTimer(uint32_t ioReg, uint8_t newValue);
 
+        // handles overflows of batched events that have already passed, 
+        // so the sound fifos have consumed every sample up to now
+        void flushOverflows();
+        // has to be called when the sound fifos change what they need from the timers
+        void updateTimerScheduling();
+
+        void reset();
+
     private:
         void stepTimerX(uint64_t cycles, uint8_t x);
 
@@ -30,6 +40,11 @@ class Timer {
 
         void queueTimerInterrupt(uint8_t x);
 
+        uint32_t getTimerXOverflowBatch(uint8_t x);
+        void updateTimerXCounter(uint8_t x);
+        // (re)schedules the overflow event of timer x, or removes it if nothing observes the overflow
+        void scheduleTimerX(uint8_t x);
+
         void calculateTimerXCounter(uint8_t x, uint64_t cyclesPassed);
 
         uint32_t timerPrescaler[4] = {1, 1, 1, 1};
@@ -48,9 +63,13 @@ class Timer {
 
         bool timerIrqEnable[4] = {false, false, false, false};
 
+        // timers without an overflow event have their counter wrapped on read instead
+        bool timerEventScheduled[4] = {false, false, false, false};
+
 
         std::shared_ptr<Bus> bus;
         std::shared_ptr<ARM7TDMI> cpu;
         std::shared_ptr<Scheduler> scheduler;
+        std::shared_ptr<APU> apu;
 
 };
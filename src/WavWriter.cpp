@@ -0,0 +1,72 @@
+#include "WavWriter.h"
+
+namespace {
+    constexpr uint16_t channels = 2;
+    constexpr uint16_t bitsPerSample = 16;
+    constexpr uint32_t headerBytes = 44;
+}
+
+WavWriter::~WavWriter() {
+    close();
+}
+
+bool WavWriter::open(const std::string& path, uint32_t sampleRate) {
+    close();
+    file.open(path, std::ios::binary | std::ios::trunc);
+    if(file.fail()) {
+        return false;
+    }
+    dataBytes = 0;
+    writeHeader(sampleRate);
+    return true;
+}
+
+void WavWriter::write(const int16_t* samples, uint32_t frameCount) {
+    if(!file.is_open()) {
+        return;
+    }
+    // .wav is little endian
+    for(uint32_t i = 0; i < frameCount * channels; i++) {
+        write16((uint16_t)samples[i]);
+    }
+    dataBytes += frameCount * channels * (bitsPerSample / 8);
+}
+
+void WavWriter::close() {
+    if(!file.is_open()) {
+        return;
+    }
+    file.seekp(4);
+    write32(headerBytes - 8 + dataBytes);
+    file.seekp(40);
+    write32(dataBytes);
+    file.close();
+}
+
+void WavWriter::writeHeader(uint32_t sampleRate) {
+    file.write("RIFF", 4);
+    write32(headerBytes - 8);
+    file.write("WAVE", 4);
+
+    file.write("fmt ", 4);
+    write32(16);
+    write16(1); // PCM
+    write16(channels);
+    write32(sampleRate);
+    write32(sampleRate * channels * (bitsPerSample / 8));
+    write16(channels * (bitsPerSample / 8));
+    write16(bitsPerSample);
+
+    file.write("data", 4);
+    write32(0);
+}
+
+void WavWriter::write32(uint32_t value) {
+    write16(value & 0xFFFF);
+    write16(value >> 16);
+}
+
+void WavWriter::write16(uint16_t value) {
+    char bytes[2] = {(char)(value & 0xFF), (char)(value >> 8)};
+    file.write(bytes, 2);
+}
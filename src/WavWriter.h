@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+/*
+    Headless audio sink, writes 16 bit stereo PCM samples to a .wav file.
+*/
+class WavWriter {
+
+    public:
+        ~WavWriter();
+
+        bool open(const std::string& path, uint32_t sampleRate);
+        // interleaved left / right samples
+        void write(const int16_t* samples, uint32_t frameCount);
+        // fills in the sizes in the header
+        void close();
+
+    private:
+        std::ofstream file;
+        uint32_t dataBytes = 0;
+
+        void writeHeader(uint32_t sampleRate);
+        void write32(uint32_t value);
+        void write16(uint16_t value);
+};
@@ -34,6 +34,36 @@ void ARM7TDMI::initializeWithRom() {
 
 ARM7TDMI::~ARM7TDMI() {}
 
+void ARM7TDMI::reset() {
+    // puts the cpu back to its power on state, initializeWithRom() sets up the boot registers afterwards
+    r0 = 0; r1 = 0; r2 = 0; r3 = 0; r4 = 0; r5 = 0; r6 = 0; r7 = 0;
+    r8 = 0; r9 = 0; r10 = 0; r11 = 0; r12 = 0; r13 = 0; r14 = 0; r15 = 0;
+    r8_fiq = 0; r9_fiq = 0; r10_fiq = 0; r11_fiq = 0; r12_fiq = 0; r13_fiq = 0; r14_fiq = 0;
+    r13_irq = 0; r14_irq = 0;
+    r13_svc = 0; r14_svc = 0;
+    r13_abt = 0; r14_abt = 0;
+    r13_und = 0; r14_und = 0;
+
+    cpsr = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    SPSR_fiq = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    SPSR_svc = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    SPSR_abt = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    SPSR_irq = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    SPSR_und = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+    overflowBit = 0;
+    carryBit = 0;
+    zeroBit = 0;
+    signBit = 0;
+    thumbLongbranchShift = 0;
+    thumbCount = 0;
+    armCount = 0;
+    currInstruction = 0;
+    currInstrAddress = 0;
+
+    switchToMode(SYSTEM);
+}
+
 uint32_t ARM7TDMI::getCurrentInstruction() {
     return currInstruction;
 }
@@ -28,6 +28,8 @@ class ARM7TDMI {
     // CPU exceptions
     void irq();
     void firq();
+
+    // clears all registers back to their power on state
     void reset();
 
     // dependency injection
@@ -3,8 +3,8 @@
  
 class BIOS {
     public:
-        uint32_t size = 0x4000;
-        uint8_t data[0x4000] = {
+        static constexpr uint32_t size = 0x4000;
+        static constexpr uint8_t data[0x4000] = {
         0x0C, 0x00, 0x00, 0xEA, 0x15, 0x00, 0x00, 0xEA, 0x15, 0x00, 0x00, 0xEA, 0x13, 0x00, 0x00, 0xEA,
         0x12, 0x00, 0x00, 0xEA, 0x11, 0x00, 0x00, 0xEA, 0x00, 0x00, 0x00, 0xEA, 0xFF, 0xFF, 0xFF, 0xEA,
         0x0F, 0x50, 0x2D, 0xE9, 0x01, 0x03, 0xA0, 0xE3, 0x0F, 0xE0, 0xA0, 0xE1, 0x04, 0xF0, 0x10, 0xE5,
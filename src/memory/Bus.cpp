@@ -3,6 +3,7 @@
 #include "BIOS.h"
 #include "../Timer.h"
 #include "../DMA.h"
+#include "../APU.h"
 #include "../arm7tdmi/ARM7TDMI.h"
 #include "../util/macros.h"
 
@@ -12,27 +13,13 @@
 #include <iostream>
 #include <iterator>
 #include <regex>
+#include <cstring>
 
 
 
 Bus::Bus() {
     // TODO: make bios configurable
-    for(int i = 0; i < 98688; i++) {
-        vRam.push_back(0);
-    }
-    BIOS biosData;
-    for(int i = 0; i < biosData.size; i++) {
-        bios.push_back(biosData.data[i]);
-    }
-    for(int i = 0; i < 263168; i++) {
-        wRamBoard.push_back(0);
-    }
-    for(int i = 0; i < 32896; i++) {
-        wRamChip.push_back(0);
-    }
-    for(int i = 0; i < 1028; i++) {
-        iORegisters.push_back(0);
-    }
+    std::memcpy(bios.data(), BIOS::data, BIOS::size);
     // Initialized to 0D000020h (by hardware). Unlike all other I/O registers, 
     // this register is mirrored across the whole I/O area (in increments of 64K, 
     // ie. at 4000800h, 4010800h, 4020800h, ..., 4FF0800h)
@@ -42,57 +29,67 @@ Bus::Bus() {
     // iORegisters[INTERNAL_MEM_CNT + 2] = 0x00;
     // iORegisters[INTERNAL_MEM_CNT + 3] = 0x0D;
 
-    for(int i = 0; i < 1028; i++) {
-        paletteRam.push_back(0);
-    }
-    for(int i = 0; i < 1028; i++) {
-        objAttributes.push_back(0);
-    }
-    for(int i = 0; i < 69000; i++) {
-        gamePakSram.push_back(0);
-    }
-    // TODO, does gamepak have to be initialized with 32MB of memory?
-    gamePakRom.resize(32000000);
+    // no cartridge inserted yet
+    static const std::vector<uint8_t> emptyGamePak;
+    gamePakRom = &emptyGamePak;
 }
 
 Bus::~Bus() {
 }
 
+void Bus::reset() {
+    wRamBoard.fill(0);
+    wRamChip.fill(0);
+    iORegisters.fill(0);
+    paletteRam.fill(0);
+    vRam.fill(0);
+    objAttributes.fill(0);
+
+    haltMode = false;
+    resetCycleCountTimeline();
+}
+
+template <typename Memory>
 inline
-uint32_t readFromArray32(std::vector<uint8_t>* arr, uint32_t address, uint32_t shift) {
+uint32_t readFromArray32(const Memory* arr, uint32_t address, uint32_t shift) {
         return (uint32_t)arr->at(address - shift) |
                (uint32_t)arr->at((address + 1) - shift) << 8 |
                (uint32_t)arr->at((address + 2) - shift) << 16 |
                (uint32_t)arr->at((address + 3) - shift) << 24;
 }
 
+template <typename Memory>
 inline
-uint16_t readFromArray16(std::vector<uint8_t>* arr, uint32_t address, uint32_t shift) {
+uint16_t readFromArray16(const Memory* arr, uint32_t address, uint32_t shift) {
         return (uint16_t)arr->at(address - shift) |
                (uint16_t)arr->at((address + 1) - shift) << 8;
 }
 
+template <typename Memory>
 inline
-uint8_t readFromArray8(std::vector<uint8_t>* arr, uint32_t address, uint32_t shift) {
+uint8_t readFromArray8(const Memory* arr, uint32_t address, uint32_t shift) {
         return (uint8_t)arr->at(address - shift);
 }
 
+template <typename Memory>
 inline
-void writeToArray32(std::vector<uint8_t>* arr, uint32_t address, uint32_t shift, uint32_t value) {
+void writeToArray32(Memory* arr, uint32_t address, uint32_t shift, uint32_t value) {
         arr->at(address - shift) = (uint8_t)value;
         arr->at((address + 1) - shift) = (uint8_t)(value >> 8);
         arr->at((address + 2) - shift) = (uint8_t)(value >> 16);
         arr->at((address + 3) - shift) = (uint8_t)(value >> 24);
 }
 
+template <typename Memory>
 inline
-void writeToArray16(std::vector<uint8_t>* arr, uint32_t address, uint32_t shift, uint16_t value) {
+void writeToArray16(Memory* arr, uint32_t address, uint32_t shift, uint16_t value) {
         arr->at(address - shift) = (uint8_t)value;
         arr->at((address + 1) - shift) = (uint8_t)(value >> 8);
 }
 
+template <typename Memory>
 inline
-void writeToArray8(std::vector<uint8_t>* arr, uint32_t address, uint32_t shift, uint8_t value) {
+void writeToArray8(Memory* arr, uint32_t address, uint32_t shift, uint8_t value) {
         arr->at(address - shift) = (uint8_t)value;
 }
 
@@ -350,6 +347,14 @@ uint32_t Bus::read(uint32_t address, uint8_t width, CycleType cycleType) {
                 // timer addresses
                 timer->updateBusToPrepareForTimerRead(address, width);
             }
+            if(0x4000004 < upperLimit && address <= 0x4000007) {
+                // DISPSTAT and VCOUNT are computed on read
+                ppu->updateBusToPrepareForLcdRead();
+            }
+            if(0x4000084 < upperLimit && address <= 0x4000084) {
+                // sound channel status bits
+                apu->updateBusToPrepareForApuRead();
+            }
 
             switch(width) {
                 case 32: {
@@ -450,15 +455,15 @@ uint32_t Bus::read(uint32_t address, uint8_t width, CycleType cycleType) {
             switch(width) {
                 case 32: {
                     memAccessCycles += 7;
-                    return readFromArray32(&gamePakRom, align32(address), 0x00000000);
+                    return readFromArray32(gamePakRom, align32(address), 0x00000000);
                 }
                 case 16: {
                     memAccessCycles += 4;
-                    return readFromArray16(&gamePakRom, align16(address), 0x00000000);            
+                    return readFromArray16(gamePakRom, align16(address), 0x00000000);            
                 }
                 case 8: {  
                     memAccessCycles += 4; 
-                    return readFromArray8(&gamePakRom, address, 0x00000000);           
+                    return readFromArray8(gamePakRom, address, 0x00000000);           
                 }
                 default: {
                     assert(false);
@@ -479,13 +484,13 @@ uint32_t Bus::read(uint32_t address, uint8_t width, CycleType cycleType) {
 
             switch(width) {
                 case 32: {
-                    return readFromArray32(&gamePakRom, align32(address), 0x00000000);
+                    return readFromArray32(gamePakRom, align32(address), 0x00000000);
                 }
                 case 16: {
-                    return readFromArray16(&gamePakRom, align16(address), 0x00000000);            
+                    return readFromArray16(gamePakRom, align16(address), 0x00000000);            
                 }
                 case 8: {
-                    return readFromArray8(&gamePakRom, address, 0x00000000);            
+                    return readFromArray8(gamePakRom, address, 0x00000000);            
                 }
                 default: {
                     assert(false);
@@ -512,13 +517,13 @@ uint32_t Bus::read(uint32_t address, uint8_t width, CycleType cycleType) {
 
             switch(width) {
                 case 32: {
-                    return readFromArray32(&gamePakRom, align32(address), 0x00000000);
+                    return readFromArray32(gamePakRom, align32(address), 0x00000000);
                 }
                 case 16: {
-                    return readFromArray16(&gamePakRom, align16(address), 0x00000000);           
+                    return readFromArray16(gamePakRom, align16(address), 0x00000000);           
                 }
                 case 8: {
-                    return readFromArray8(&gamePakRom, address, 0x00000000);            
+                    return readFromArray8(gamePakRom, address, 0x00000000);            
                 }
                 default: {
                     assert(false);
@@ -649,6 +654,19 @@ void Bus::write(uint32_t address, uint32_t value, uint8_t width, CycleType acces
                 dma->updateDmaUponWrite(address, value, width);
             }
 
+            bool soundAddress = 0x4000060 < upperLimit && address <= 0x40000A7;
+            if(soundAddress) {
+                // renders the samples up to now with the old settings
+                apu->prepareForApuWrite(address, width);
+            }
+
+            bool displayAddress = address <= 0x4000057 && (address & ~0x3) != 0x4000004;
+            if(displayAddress) {
+                // lcd registers other than DISPSTAT and VCOUNT, renders the lines up to now with the old settings
+                ppu->catchUp();
+                ppu->setDisplayRegistersDirty((address & ~(width / 8 - 1)) - 0x4000000, width / 8);
+            }
+
             switch(width) {
                 case 32: {
                     writeToArray32(&iORegisters, align32(address), 0x04000000, value); 
@@ -688,6 +706,15 @@ void Bus::write(uint32_t address, uint32_t value, uint8_t width, CycleType acces
                 }
             }   
 
+            if((0x4000004 < upperLimit && address <= 0x4000005) || (0x40000BA <= upperLimit && address <= 0x40000DF)) {
+                // lcd irq settings or dma start timings changed, the ppu may have to observe other transitions
+                ppu->updateLineEventScheduling();
+            }
+
+            if(soundAddress) {
+                apu->updateApuUponWrite(address, value, width);
+            }
+
             if(address == 0x04000301) {
                 // halt register hit
                 if(!(iORegisters[HALTCNT] & 0x80)) {
@@ -697,6 +724,7 @@ void Bus::write(uint32_t address, uint32_t value, uint8_t width, CycleType acces
             break;
         }
         case 0x05: {  
+            ppu->catchUp();
             address &= 0x050003FF;
             switch(width) {
                 case 32: {
@@ -721,9 +749,11 @@ void Bus::write(uint32_t address, uint32_t value, uint8_t width, CycleType acces
                     break;
                 }
             } 
+            ppu->setPaletteDirty();
             break;
         } 
         case 0x06: {  
+            ppu->catchUp();
 
             // Even though VRAM is sized 96K (64K+32K), it is repeated in steps of 128K 
             // (64K+32K+32K, the two 32K blocks itself being mirrors of each other).
@@ -752,10 +782,11 @@ void Bus::write(uint32_t address, uint32_t value, uint8_t width, CycleType acces
                     break;
                 }
             }
-        
+            ppu->setVramDirty(address - 0x06000000, width / 8);
             break;
         } 
         case 0x07: {   
+            ppu->catchUp();
             // TODO: there are more hblank rules to implement
             address &= 0x070003FF;
             switch(width) {
@@ -778,6 +809,7 @@ void Bus::write(uint32_t address, uint32_t value, uint8_t width, CycleType acces
                     break;
                 }
             }
+            ppu->setObjectsDirty();
             break;   
 
         }
@@ -792,15 +824,15 @@ void Bus::write(uint32_t address, uint32_t value, uint8_t width, CycleType acces
 
             switch(width) {
                 case 32: {
-                    //writeToArray32(&gamePakRom, address, 0x08000000, value);
+                    //writeToArray32(gamePakRom, address, 0x08000000, value);
                     break;
                 }
                 case 16: {
-                    //writeToArray16(&gamePakRom, address, 0x08000000, value);         
+                    //writeToArray16(gamePakRom, address, 0x08000000, value);         
                     break;   
                 }
                 case 8: {
-                    //writeToArray8(&gamePakRom, address, 0x08000000, value);          
+                    //writeToArray8(gamePakRom, address, 0x08000000, value);          
                     break;  
                 }
                 default: {
@@ -823,15 +855,15 @@ void Bus::write(uint32_t address, uint32_t value, uint8_t width, CycleType acces
 
             switch(width) {
                 case 32: {
-                    //writeToArray32(&gamePakRom, address, 0x0A000000, value);
+                    //writeToArray32(gamePakRom, address, 0x0A000000, value);
                     break;
                 }
                 case 16: {
-                    //writeToArray16(&gamePakRom, address, 0x0A000000, value);         
+                    //writeToArray16(gamePakRom, address, 0x0A000000, value);         
                     break;   
                 }
                 case 8: {
-                    //writeToArray8(&gamePakRom, address, 0x0A000000, value);           
+                    //writeToArray8(gamePakRom, address, 0x0A000000, value);           
                     break;
                 }
                 default: {
@@ -858,15 +890,15 @@ void Bus::write(uint32_t address, uint32_t value, uint8_t width, CycleType acces
 
             switch(width) {
                 case 32: {
-                    //writeToArray32(&gamePakRom, address, 0x0C000000, value);
+                    //writeToArray32(gamePakRom, address, 0x0C000000, value);
                     break;
                 }
                 case 16: {
-                    //writeToArray16(&gamePakRom, address, 0x0C000000, value);            
+                    //writeToArray16(gamePakRom, address, 0x0C000000, value);            
                     break;
                 }
                 case 8: {
-                    //writeToArray8(&gamePakRom, address, 0x0C000000, value);            
+                    //writeToArray8(gamePakRom, address, 0x0C000000, value);            
                     break;
                 }
                 default: {
@@ -920,6 +952,70 @@ void Bus::write(uint32_t address, uint32_t value, uint8_t width, CycleType acces
     }
 }
 
+uint8_t* Bus::getPlainMemoryForWrite(uint32_t address, uint32_t length) {
+    switch((address & 0xFF000000) >> 24) {
+        case 0x02: {
+            uint32_t offset = address & 0x3FFFF;
+            return (offset + length <= 0x40000) ? &wRamBoard[offset] : nullptr;
+        }
+        case 0x03: {
+            uint32_t offset = address & 0x7FFF;
+            return (offset + length <= 0x8000) ? &wRamChip[offset] : nullptr;
+        }
+        case 0x05: {
+            uint32_t offset = address & 0x3FF;
+            if(offset + length > 0x400) {
+                return nullptr;
+            }
+            // the caller writes the whole range
+            ppu->catchUp();
+            ppu->setPaletteDirty();
+            return &paletteRam[offset];
+        }
+        case 0x06: {
+            // same mirroring as read/write, the upper 32K block is repeated twice
+            uint32_t offset = (address & 0x00010000) ? 0x10000 + (address & 0x7FFF) : (address & 0xFFFF);
+            uint32_t regionEnd = (address & 0x00010000) ? 0x18000 : 0x10000;
+            if(offset + length > regionEnd) {
+                return nullptr;
+            }
+            // the caller writes the whole range
+            ppu->catchUp();
+            ppu->setVramDirty(offset, length);
+            return &vRam[offset];
+        }
+        case 0x07: {
+            uint32_t offset = address & 0x3FF;
+            if(offset + length > 0x400) {
+                return nullptr;
+            }
+            // the caller writes the whole range
+            ppu->catchUp();
+            ppu->setObjectsDirty();
+            return &objAttributes[offset];
+        }
+        default: {
+            // io registers, bios, gamepak and save memory have side effects or are read only
+            return nullptr;
+        }
+    }
+}
+
+const uint8_t* Bus::getPlainMemoryForRead(uint32_t address, uint32_t length) {
+    uint32_t shift = (address & 0xFF000000) >> 24;
+    if(0x08 <= shift && shift <= 0x0D) {
+        uint32_t offset = address & 0x00FFFFFF;
+        if(gamePakRom == nullptr || offset + length > 0x01000000) {
+            return nullptr;
+        }
+        if(cartSaveType == EEPROM_TYPE && (offset + length > 0x00FFFF00 || (shift == 0x0D && !largeCart))) {
+            return nullptr;
+        }
+        return gamePakRom->data() + offset;
+    }
+    return getPlainMemoryForWrite(address, length);
+}
+
 uint32_t Bus::view32(uint32_t address) {
     return view(address, 32);
 }
@@ -1105,13 +1201,13 @@ uint32_t Bus::view(uint32_t address, uint8_t width) {
             address &= 0x00FFFFFF;
             switch(width) {
                 case 32: {
-                    return readFromArray32(&gamePakRom, align32(address), 0x00000000);
+                    return readFromArray32(gamePakRom, align32(address), 0x00000000);
                 }
                 case 16: {
-                    return readFromArray16(&gamePakRom, align16(address), 0x00000000);            
+                    return readFromArray16(gamePakRom, align16(address), 0x00000000);            
                 }
                 case 8: {  
-                    return readFromArray8(&gamePakRom, address, 0x00000000);           
+                    return readFromArray8(gamePakRom, address, 0x00000000);           
                 }
                 default: {
                     assert(false);
@@ -1127,13 +1223,13 @@ uint32_t Bus::view(uint32_t address, uint8_t width) {
             address &= 0x00FFFFFF;
             switch(width) {
                 case 32: {
-                    return readFromArray32(&gamePakRom, align32(address), 0x00000000);
+                    return readFromArray32(gamePakRom, align32(address), 0x00000000);
                 }
                 case 16: {
-                    return readFromArray16(&gamePakRom, align16(address), 0x00000000);            
+                    return readFromArray16(gamePakRom, align16(address), 0x00000000);            
                 }
                 case 8: {
-                    return readFromArray8(&gamePakRom, address, 0x00000000);            
+                    return readFromArray8(gamePakRom, address, 0x00000000);            
                 }
                 default: {
                     assert(false);
@@ -1149,13 +1245,13 @@ uint32_t Bus::view(uint32_t address, uint8_t width) {
             address &= 0x00FFFFFF;
             switch(width) {
                 case 32: {
-                    return readFromArray32(&gamePakRom, align32(address), 0x00000000);
+                    return readFromArray32(gamePakRom, align32(address), 0x00000000);
                 }
                 case 16: {
-                    return readFromArray16(&gamePakRom, align16(address), 0x00000000);           
+                    return readFromArray16(gamePakRom, align16(address), 0x00000000);           
                 }
                 case 8: {
-                    return readFromArray8(&gamePakRom, address, 0x00000000);            
+                    return readFromArray8(gamePakRom, address, 0x00000000);            
                 }
                 default: {
                     assert(false);
@@ -1197,36 +1293,39 @@ uint32_t Bus::view(uint32_t address, uint8_t width) {
     return 436207618U;
 }
 
-void Bus::loadRom(std::vector<uint8_t> &buffer) {
-    // TODO: assert that roms are smaller than 32MB
+void Bus::loadRom(std::shared_ptr<const RomRegistry::RomImage> rom) {
+    gamePak = rom;
+    gamePakRom = &rom->data;
 
-    std::string s{buffer.begin(), buffer.end()};
+    // search the rom in place rather than copying it into a string
+    const char* romBegin = reinterpret_cast<const char*>(rom->data.data());
+    const char* romEnd = romBegin + rom->romSize;
     std::regex eepromRegex = std::regex{"EEPROM_V\\d\\d\\d"};
     std::regex sramRegex = std::regex{"SRAM_V\\d\\d\\d"};
     std::regex flashRegex = std::regex{"FLASH_V\\d\\d\\d"};
     std::regex flash512Regex = std::regex{"FLASH512_V\\d\\d\\d"};
     std::regex flash1MbRegex = std::regex{"FLASH1M_V\\d\\d\\d"};
 
-    if(std::regex_search(s, eepromRegex)) {
+    if(std::regex_search(romBegin, romEnd, eepromRegex)) {
 
         cartSaveType = Bus::CartSaveType::EEPROM_TYPE;
         std::cout << "eeprom save type\n";
         dma->eepromBusWidthDetected = false;
-    } else if(std::regex_search(s, sramRegex)) {
+    } else if(std::regex_search(romBegin, romEnd, sramRegex)) {
 
         cartSaveType = Bus::CartSaveType::SRAM_TYPE;
         std::cout << "sram save type\n";
-    } else if(std::regex_search(s, flashRegex)) {
+    } else if(std::regex_search(romBegin, romEnd, flashRegex)) {
 
         flash.setSize(512);
         cartSaveType = Bus::CartSaveType::FLASH512_TYPE;
         std::cout << "flash512 save type\n";
-    } else if(std::regex_search(s, flash512Regex)) {
+    } else if(std::regex_search(romBegin, romEnd, flash512Regex)) {
 
         flash.setSize(512);
         cartSaveType = Bus::CartSaveType::FLASH512_TYPE;
         std::cout << "flash512 save type\n";
-    } else if(std::regex_search(s, flash1MbRegex)) {
+    } else if(std::regex_search(romBegin, romEnd, flash1MbRegex)) {
 
         flash.setSize(1024);
         cartSaveType = Bus::CartSaveType::FLASH1024_TYPE;
@@ -1237,14 +1336,10 @@ void Bus::loadRom(std::vector<uint8_t> &buffer) {
         cartSaveType = Bus::CartSaveType::SRAM_TYPE;
     }
 
-    largeCart = (buffer.size() > 0x1000000);
+    largeCart = (rom->romSize > 0x1000000);
     if(largeCart) {
         std::cout << "large cartridge\n";
     }
-
-    for (int i = 0; i < buffer.size(); i++) {
-        gamePakRom[i] = buffer[i];
-    }
 }
 
 
@@ -1335,6 +1430,10 @@ void Bus::connectPpu(std::shared_ptr<PPU> _ppu) {
     this->ppu = _ppu;
 }
 
+void Bus::connectApu(std::shared_ptr<APU> apu) {
+    this->apu = apu;
+}
+
 // TODO: can make static ?
 bool Bus::isAddressInEeprom(uint32_t address) {
     if((address & 0xFF000000) < 0x08000000 || (address & 0xFF000000) > 0x0D000000) {
@@ -7,6 +7,7 @@
 #include <memory>
 #include "EEPROM.h"
 #include "Flash.h"
+#include "RomRegistry.h"
 
 //#define LARGE_CARTRIDGE 1;
 #define FLASH_CART 1;
@@ -15,6 +16,7 @@ class PPU;
 class Timer;
 class ARM7TDMI;
 class DMA;
+class APU;
 
 class Bus {
     // TODO: implement an OPEN BUS (ie if retreiving invalid mem location, return value last on bus)
@@ -29,6 +31,7 @@ class Bus {
     void connectTimer(std::shared_ptr<Timer> timer);
     void connectDma(std::shared_ptr<DMA> dma);
     void connectPpu(std::shared_ptr<PPU> ppu);
+    void connectApu(std::shared_ptr<APU> apu);
 
     enum CycleType {
         SEQUENTIAL,
@@ -84,6 +87,8 @@ class Bus {
         */
         INTERNAL_MEM_CNT = 0x04000800 - 0x04000000,
 
+        SOUNDBIAS = 0x04000088 - 0x04000000, // Sound PWM Control (R/W)
+
         HALTCNT = 0x04000301 - 0x04000000   // HALTCNT - BYTE - Undocumented - Low Power Mode Control (W)
 
     };
@@ -102,33 +107,35 @@ class Bus {
     /* General Internal Memory */
 
     // 00000000-00003FFF   BIOS - System ROM (16 KBytes) 16448
-    std::vector<uint8_t> bios;
+    std::array<uint8_t, 0x4000> bios = {};
     // work ram! 02000000-0203FFFF (256kB) 263168
-    std::vector<uint8_t> wRamBoard;
+    std::array<uint8_t, 263168> wRamBoard = {};
     // 03000000-03007FFF (32 kB) 32896
-    std::vector<uint8_t> wRamChip;
+    std::array<uint8_t, 32896> wRamChip = {};
     // 04000000-040003FE   I/O Registers 1028
-    std::vector<uint8_t> iORegisters;
+    std::array<uint8_t, 1028> iORegisters = {};
 
     /* Internal Display Memory */
 
     // 05000000-050003FF   BG/OBJ Palette RAM        (1 Kbyte) 1028
-    std::vector<uint8_t> paletteRam;
+    std::array<uint8_t, 1028> paletteRam = {};
     // 06000000-06017FFF   VRAM - Video RAM          (96 KBytes) 98688
-    std::vector<uint8_t> vRam;
+    std::array<uint8_t, 98688> vRam = {};
     // 07000000-070003FF   OAM - OBJ Attributes      (1 Kbyte) 1028
     // TODO: VRAM and Palette RAM may be accessed during H-Blanking. 
     // OAM can accessed only if "H-Blank Interval Free" bit in DISPCNT register is set.
-    std::vector<uint8_t> objAttributes;
+    std::array<uint8_t, 1028> objAttributes = {};
 
     /* External Memory (Game Pak) */
 
     // 08000000-09FFFFFF   Game Pak ROM/FlashROM (max 32MB) - Wait State 0
     // 0A000000-0BFFFFFF   Game Pak ROM/FlashROM (max 32MB) - Wait State 1
     // 0C000000-0DFFFFFF   Game Pak ROM/FlashROM (max 32MB) - Wait State 2
-    std::vector<uint8_t> gamePakRom;
+    // the image is read only and shared with every other instance running the same ROM (see RomRegistry)
+    std::shared_ptr<const RomRegistry::RomImage> gamePak;
+    const std::vector<uint8_t>* gamePakRom;
     // 0E000000-0E00FFFF   Game Pak SRAM    (max 64 KBytes) - 8bit Bus width (65792)
-    std::vector<uint8_t> gamePakSram;
+    std::array<uint8_t, 69000> gamePakSram = {};
 
 
     uint32_t read32(uint32_t address, CycleType accessType);
@@ -137,11 +144,21 @@ class Bus {
 
     uint32_t view32(uint32_t address);
 
+    // returns the backing memory of [address, address + length) if the whole range lies in one plain memory 
+    // region (no side effects on access, no mirror wrap inside the range), otherwise nullptr.
+    // lets dma move whole blocks instead of going through read/write one unit at a time
+    uint8_t* getPlainMemoryForWrite(uint32_t address, uint32_t length);
+    const uint8_t* getPlainMemoryForRead(uint32_t address, uint32_t length);
+
     void write32(uint32_t address, uint32_t word, CycleType accessType);
     void write16(uint32_t address, uint16_t halfWord, CycleType accessType);
     void write8(uint32_t address, uint8_t byte, CycleType accessType);
 
-    void loadRom(std::vector<uint8_t> &buffer);
+    void loadRom(std::shared_ptr<const RomRegistry::RomImage> rom);
+
+    // clears all volatile memory back to its power on state. 
+    // The loaded ROM and the cartridge save memory are kept
+    void reset();
 
     uint8_t getCurrentNWaitstate();
     uint8_t getCurrentSWaitstate();
@@ -159,8 +176,6 @@ class Bus {
     void leaveVBlank();
     void leaveHBlank();
 
-    bool ppuMemDirty = false;
-
     uint32_t getMemoryAccessCycles();
 
     bool isAddressInEeprom(uint32_t address);
@@ -204,6 +219,7 @@ class Bus {
     std::shared_ptr<PPU> ppu;
     std::shared_ptr<Timer> timer; 
     std::shared_ptr<DMA> dma;
+    std::shared_ptr<APU> apu;
     EEPROM eeprom;
     Flash flash;
 
@@ -0,0 +1,38 @@
+#include "RomRegistry.h"
+#include "../util/macros.h"
+
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+
+std::mutex RomRegistry::registryMutex;
+std::unordered_map<std::string, std::weak_ptr<const RomRegistry::RomImage>> RomRegistry::images;
+
+std::shared_ptr<const RomRegistry::RomImage> RomRegistry::load(const std::string& path) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+
+    auto it = images.find(path);
+    if(it != images.end()) {
+        std::shared_ptr<const RomImage> image = it->second.lock();
+        if(image != nullptr) {
+            return image;
+        }
+    }
+
+    std::ifstream binFile(path, std::ios::binary);
+    if(binFile.fail()) {
+        return nullptr;
+    }
+
+    std::shared_ptr<RomImage> image = std::make_shared<RomImage>();
+    image->data.assign(std::istreambuf_iterator<char>(binFile), {});
+    image->romSize = image->data.size();
+    if(image->romSize > MAX_ROM_SIZE) {
+        DEBUGWARN("rom is larger than 32MB, truncating\n");
+        image->romSize = MAX_ROM_SIZE;
+    }
+    image->data.resize(std::max(image->romSize, MIN_IMAGE_SIZE), 0);
+
+    images[path] = image;
+    return image;
+}
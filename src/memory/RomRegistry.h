@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+/*
+    Process-wide cache of game pak ROM images. Every Bus running the same title
+    gets a shared, immutable view of a single copy of the ROM instead of owning its own.
+    Images are released once the last instance holding them is destroyed.
+*/
+class RomRegistry {
+
+    public:
+        struct RomImage {
+            // padded with zeros up to at least MIN_IMAGE_SIZE so that masked gamepak
+            // addresses never index past the end of the buffer
+            std::vector<uint8_t> data;
+            // size of the ROM file itself, without the padding
+            size_t romSize;
+        };
+
+        // the bus masks gamepak addresses with 0x00FFFFFF
+        static constexpr size_t MIN_IMAGE_SIZE = 0x1000000;
+        static constexpr size_t MAX_ROM_SIZE = 0x2000000;
+
+        // returns nullptr if the file could not be read
+        static std::shared_ptr<const RomImage> load(const std::string& path);
+
+    private:
+        static std::mutex registryMutex;
+        static std::unordered_map<std::string, std::weak_ptr<const RomImage>> images;
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <algorithm>
+
+/*
+    Lock free single producer / single consumer ring buffer.
+    push() may only be called from one thread and pop() from one other thread.
+    The indices run freely and are masked on access, so Capacity has to be a power of two.
+*/
+template <typename T, size_t Capacity>
+class RingBuffer {
+    static_assert(Capacity != 0 && (Capacity & (Capacity - 1)) == 0, "RingBuffer capacity has to be a power of two");
+
+    public:
+        // producer side, returns the number of elements that fit
+        size_t push(const T* data, size_t count) {
+            size_t write = writeIndex.load(std::memory_order_relaxed);
+            size_t read = readIndex.load(std::memory_order_acquire);
+            count = std::min(count, Capacity - (write - read));
+            for(size_t i = 0; i < count; i++) {
+                buffer[(write + i) & (Capacity - 1)] = data[i];
+            }
+            writeIndex.store(write + count, std::memory_order_release);
+            return count;
+        }
+
+        // consumer side, returns the number of elements taken
+        size_t pop(T* data, size_t count) {
+            size_t read = readIndex.load(std::memory_order_relaxed);
+            size_t write = writeIndex.load(std::memory_order_acquire);
+            count = std::min(count, write - read);
+            for(size_t i = 0; i < count; i++) {
+                data[i] = buffer[(read + i) & (Capacity - 1)];
+            }
+            readIndex.store(read + count, std::memory_order_release);
+            return count;
+        }
+
+        // can be called from either side, the other side may have moved on already
+        size_t size() const {
+            // read index first, the write index can only have moved further ahead of it
+            size_t read = readIndex.load(std::memory_order_acquire);
+            return writeIndex.load(std::memory_order_acquire) - read;
+        }
+
+        static constexpr size_t capacity() {
+            return Capacity;
+        }
+
+    private:
+        std::array<T, Capacity> buffer;
+        // on separate cache lines so producer and consumer don't invalidate each other
+        alignas(64) std::atomic<size_t> writeIndex{0};
+        alignas(64) std::atomic<size_t> readIndex{0};
+};
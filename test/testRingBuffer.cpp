@@ -0,0 +1,60 @@
+#include <cstdint>
+#include <iostream>
+#include <thread>
+#include <assert.h>
+
+#include "../src/util/RingBuffer.h"
+
+void testWrapAround() {
+    RingBuffer<int16_t, 8> ring;
+    int16_t in[6] = {1, 2, 3, 4, 5, 6};
+    int16_t out[8];
+
+    assert(ring.push(in, 6) == 6);
+    assert(ring.pop(out, 4) == 4);
+    assert(out[0] == 1 && out[3] == 4);
+    // only 6 of the 8 slots are free, the rest is dropped
+    assert(ring.push(in, 6) == 6);
+    assert(ring.push(in, 6) == 0);
+    assert(ring.size() == 8);
+    assert(ring.pop(out, 8) == 8);
+    assert(out[0] == 5 && out[1] == 6 && out[2] == 1 && out[7] == 6);
+    assert(ring.pop(out, 1) == 0);
+}
+
+void testProducerConsumer() {
+    RingBuffer<uint32_t, 1024> ring;
+    const uint32_t count = 1000000;
+
+    std::thread producer([&]() {
+        uint32_t next = 0;
+        while(next < count) {
+            uint32_t batch[37];
+            uint32_t batchSize = std::min<uint32_t>(37, count - next);
+            for(uint32_t i = 0; i < batchSize; i++) {
+                batch[i] = next + i;
+            }
+            next += ring.push(batch, batchSize);
+        }
+    });
+
+    // every value arrives exactly once and in order
+    uint32_t expected = 0;
+    while(expected < count) {
+        uint32_t batch[53];
+        size_t popped = ring.pop(batch, 53);
+        for(size_t i = 0; i < popped; i++) {
+            assert(batch[i] == expected);
+            expected++;
+        }
+    }
+    producer.join();
+    assert(ring.size() == 0);
+}
+
+int main() {
+    testWrapAround();
+    testProducerConsumer();
+    std::cout << "ring buffer tests passed\n";
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include <cstdint>
+#include <iostream>
+#include <assert.h>
+
+#include "../src/Scheduler.h"
+#include "../src/GameBoyAdvanceImpl.h"
+
+Scheduler::EventType popEvent(Scheduler& scheduler, uint64_t currentCycle) {
+    Scheduler::Event* event = scheduler.getNextEvent(currentCycle);
+    assert(event != nullptr);
+    return event->eventType;
+}
+
+void testOrdering() {
+    Scheduler scheduler;
+    GameBoyAdvanceImpl::cyclesSinceStart = 0;
+
+    scheduler.addEvent(Scheduler::DMA0, 300, Scheduler::NULL_CONDITION);
+    scheduler.addEvent(Scheduler::TIMER1, 100, Scheduler::NULL_CONDITION);
+    scheduler.addEvent(Scheduler::TIMER0, 100, Scheduler::NULL_CONDITION);
+    scheduler.addEvent(Scheduler::PPU_LINE, 200, Scheduler::NULL_CONDITION);
+    // rescheduling an event replaces its old deadline
+    scheduler.addEvent(Scheduler::DMA0, 50, Scheduler::NULL_CONDITION);
+
+    assert(scheduler.getNextEvent(49) == (Scheduler::Event*)nullptr);
+    assert(scheduler.peekNextEvent()->eventType == Scheduler::DMA0);
+    assert(popEvent(scheduler, 50) == Scheduler::DMA0);
+    // same deadline, lower event type first
+    assert(popEvent(scheduler, 1000) == Scheduler::TIMER0);
+    assert(popEvent(scheduler, 1000) == Scheduler::TIMER1);
+
+    scheduler.removeEvent(Scheduler::PPU_LINE);
+    assert(scheduler.peekNextEvent() == (Scheduler::Event*)nullptr);
+}
+
+void testSameCyclePriority() {
+    Scheduler scheduler;
+    GameBoyAdvanceImpl::cyclesSinceStart = 960;
+
+    scheduler.addEvent(Scheduler::DMA3, 0, Scheduler::HBLANK_START);
+    scheduler.addEvent(Scheduler::TIMER2, 0, Scheduler::NULL_CONDITION);
+    scheduler.addEvent(Scheduler::DMA1, 0, Scheduler::HBLANK_START);
+    scheduler.addEvent(Scheduler::PPU_LINE, 0, Scheduler::NULL_CONDITION);
+
+    // the ppu runs first, dmas run last in dma priority order
+    assert(popEvent(scheduler, 960) == Scheduler::PPU_LINE);
+    assert(popEvent(scheduler, 960) == Scheduler::TIMER2);
+    assert(popEvent(scheduler, 960) == Scheduler::DMA1);
+    Scheduler::Event* hblankDma = scheduler.getNextEvent(960);
+    assert(hblankDma->eventType == Scheduler::DMA3);
+    assert(hblankDma->startCycle == (uint64_t)960);
+    assert(hblankDma->eventCondition == Scheduler::HBLANK_START);
+}
+
+void testRebasing() {
+    Scheduler scheduler;
+    // deadlines are stored relative to a base cycle, make sure they survive long runs
+    for(uint64_t cycle = 0; cycle < 0x400000000; cycle += 0x10000000) {
+        GameBoyAdvanceImpl::cyclesSinceStart = cycle;
+        scheduler.addEvent(Scheduler::TIMER2, 0x3000000, Scheduler::NULL_CONDITION);
+        scheduler.addEvent(Scheduler::TIMER3, 0x1000, Scheduler::NULL_CONDITION);
+        assert(popEvent(scheduler, cycle + 0x1000) == Scheduler::TIMER3);
+        assert(scheduler.peekNextEvent()->startCycle == cycle + 0x3000000);
+        assert(popEvent(scheduler, cycle + 0x3000000) == Scheduler::TIMER2);
+    }
+    GameBoyAdvanceImpl::cyclesSinceStart = 0;
+}
+
+int main() {
+    testOrdering();
+    testSameCyclePriority();
+    testRebasing();
+    std::cout << "scheduler tests passed\n";
+    return 0;
+}